@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    //qsort_r
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -6,176 +7,4339 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <limits.h>
 
-/* linked list w/ subroutines */
+/* arena allocator */
 
-struct node {
-    char *path;
-    int level;
-    struct node *next;
-    struct node *prev;
+#define ARENA_CHUNK (1 << 20)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
 };
 
-struct list {
-    struct node *head;
-    struct node *tail;
+struct arena {              //bump allocator; everything is released at once
+    struct arena_chunk *head;
+    size_t chunks;
+    size_t used;            //bytes handed out
+    size_t reserved;        //bytes obtained from malloc
 };
 
-//creation subroutines
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct arena_chunk) + csize);
+        if (chunk == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for arena; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        chunk->used = 0;
+        chunk->size = csize;
+        chunk->next = arena->head;
+        arena->head = chunk;
+        arena->chunks++;
+        arena->reserved += sizeof(struct arena_chunk) + csize;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return p;
+}
 
-struct node *create_node(char *path, int level)
+char *arena_strdup(struct arena *arena, const char *s)
 {
-    struct node *node = malloc(sizeof(struct node));
-    if (node == NULL) {
-        fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(arena, len), s, len);
+}
+
+/* moves src's chunks onto dst; src is left empty */
+void arena_splice(struct arena *dst, struct arena *src)
+{
+    struct arena_chunk **tail = &src->head;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = dst->head;
+    dst->head = src->head;
+    dst->chunks += src->chunks;
+    dst->used += src->used;
+    dst->reserved += src->reserved;
+    memset(src, 0, sizeof(struct arena));
+}
+
+void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk = arena->head, *tmp;
+    while (chunk != NULL) {
+        tmp = chunk;
+        chunk = chunk->next;
+        free(tmp);
+    }
+    memset(arena, 0, sizeof(struct arena));
+}
+
+/* grows an array of elem-sized items to hold at least need, doubling */
+void *grow_array(void *p, size_t *capacity, size_t need, size_t elem)
+{
+    if (need <= *capacity)
+        return p;
+    size_t capacity_new = *capacity ? *capacity : 1024;
+    while (capacity_new < need)
+        capacity_new *= 2;
+    if ((p = realloc(p, capacity_new * elem)) == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for array; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    *capacity = capacity_new;
+    return p;
+}
+
+/* output writer */
+
+/* Lines are formatted by hand into a large buffer and handed to the kernel
+ * in multi-MiB writes. A positional writer uses pwrite() from a fixed
+ * offset instead, so several threads can fill disjoint parts of one file. */
+
+#define OUT_BUFSIZE (4 << 20)
+
+struct writer {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+    int positional;
+    off_t offset;           //next pwrite() position for a positional writer
+    long bytes;             //total handed to the kernel
+};
+
+void open_writer(struct writer *w, int fd, int positional, off_t offset)
+{
+    w->fd = fd;
+    w->len = 0;
+    w->size = OUT_BUFSIZE;
+    w->positional = positional;
+    w->offset = offset;
+    w->bytes = 0;
+    if ((w->buf = malloc(OUT_BUFSIZE)) == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+}
+
+void flush_writer(struct writer *w)
+{
+    size_t done = 0;
+    while (done < w->len) {
+        ssize_t n = w->positional ? pwrite(w->fd, w->buf + done, w->len - done, w->offset + done)
+                                  : write(w->fd, w->buf + done, w->len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "%s: couldn't write output; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        done += n;
+    }
+    w->offset += w->len;
+    w->bytes += w->len;
+    w->len = 0;
+}
+
+void close_writer(struct writer *w)
+{
+    flush_writer(w);
+    free(w->buf);
+    w->buf = NULL;
+}
+
+size_t format_uint(char *p, unsigned long v)
+{
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    for (size_t i = 0; i < n; i++)
+        p[i] = digits[n - 1 - i];
+    return n;
+}
+
+size_t uint_width(unsigned long v)
+{
+    size_t n = 1;
+    while (v >= 10) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+/* the byte length of the line write_line() produces for the same arguments */
+size_t line_length(int level, size_t order, size_t plen, size_t nlen)
+{
+    return uint_width(level) + uint_width(order) + plen + (nlen ? nlen + 1 : 0) + 3;
+}
+
+/* room for need more bytes at the end of the buffer */
+char *reserve_output(struct writer *w, size_t need)
+{
+    if (w->len + need > w->size) {
+        flush_writer(w);
+        if (need > w->size) {       //a path longer than the whole buffer; make room for it
+            w->size = need;
+            if ((w->buf = realloc(w->buf, w->size)) == NULL) {
+                fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+    }
+    return w->buf + w->len;
+}
+
+void write_bytes(struct writer *w, const void *data, size_t n)
+{
+    memcpy(reserve_output(w, n), data, n);
+    w->len += n;
+}
+
+/* appends "level:order:prefix[/name]\n"; name may be NULL */
+void write_line(struct writer *w, int level, size_t order, const char *prefix, size_t plen, const char *name, size_t nlen)
+{
+    char *p = reserve_output(w, line_length(level, order, plen, name ? nlen : 0));
+    p += format_uint(p, level);
+    *p++ = ':';
+    p += format_uint(p, order);
+    *p++ = ':';
+    memcpy(p, prefix, plen);
+    p += plen;
+    if (name != NULL) {
+        *p++ = '/';
+        memcpy(p, name, nlen);
+        p += nlen;
+    }
+    *p++ = '\n';
+    w->len = p - w->buf;
+}
+
+int create_output(char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", filename, strerror(errno));
         exit(-1);
     }
-    node->path = strdup(path);
-    node->level = level;
-    node->next = NULL;
-    node->prev = NULL;
-    return node;
+    return fd;
+}
+
+/* node array w/ subroutines */
+
+/* workers index nodes in their own lists until the merge, so a parent
+ * reference carries the owning worker in its top bits */
+#define NODE_REF_SHIFT 40
+
+size_t node_ref(int worker, size_t index)
+{
+    return ((size_t) worker << NODE_REF_SHIFT) | index;
 }
 
+#define NO_PARENT UINT32_MAX
+#define NODE_DIR 1
+#define NODE_DEAD 2             //removed by --watch; kept so indices stay stable
+#define NODE_SEEN 4             //--diff: matched a reference line on its level
+#define NODE_BYTES (sizeof(char *) + sizeof(uint32_t) + sizeof(uint16_t) + 1)     //per node, across the arrays
+
+/* Entries form a name tree: a node holds only its own name and its parent's
+ * index, and full paths are rebuilt while printing. The nodes are kept as
+ * parallel arrays, so a pass that only needs levels or parents (the sort's
+ * bucketing, the print's parent chains) streams through a few bytes per
+ * node rather than whole records. The names themselves sit in the arena in
+ * discovery order, so siblings' names are next to each other as well. */
+
+struct dir_stat {           //identity and timestamps of a directory that was opened
+    size_t node;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+struct list {
+    char **names;           //the root's name is the path it was listed from
+    uint32_t *parents;      //index of the parent, or NO_PARENT for the root
+    uint16_t *levels;
+    uint8_t *flags;         //NODE_DIR, NODE_DEAD, NODE_SEEN
+    uint16_t *owners;       //while walking: the worker whose list holds each parent
+    int walking;            //parents are split node refs until the walk's merge
+    uint64_t *sizes;        //--sizes: st_size, then the subtree total (see write_sizes)
+    uint64_t *blocks;       //--sizes: st_blocks, likewise
+    int sizing;             //keep the two columns above
+    size_t count;           //nodes, in discovery order
+    size_t capacity;
+    uint32_t *order;        //sorted live nodes, filled by sort_list()
+    size_t norder;
+    struct dir_stat *dirs;  //only recorded for --snapshot
+    size_t ndirs;
+    size_t dirs_capacity;
+    struct arena arena;     //owns every node's name
+};
+
+//creation subroutines
+
 struct list *create_list()
 {
-    struct list *list = malloc(sizeof(struct list));
+    struct list *list = calloc(1, sizeof(struct list));
     if (list == NULL) {
         fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
         exit(-1);
     }
-    list->head = NULL;
-    list->tail = NULL;
     return list;
 }
 
 //inserts
 
-void insert_sorted(struct node *node, struct list *list)
-{
-    if (list->head == NULL && list->tail == NULL) {
-        list->head = node;
-        list->tail = node;
-    } else if (strcmp(node->path, list->head->path) <= 0) {
-        list->head->prev = node;
-        node->next = list->head;
-        list->head = node;
-    } else if (strcmp(node->path, list->tail->path) > 0) {
-        list->tail->next = node;
-        node->prev = list->tail;
-        list->tail = node;
-    } else {
-        struct node *ptr = list->head;
-        while (ptr->next != NULL && strcmp(node->path, ptr->path) > 0)
-            ptr = ptr->next;
-        node->next = ptr;
-        node->prev = ptr->prev;
-        ptr->prev->next = node;
-        ptr->prev = node;
+void resize_nodes(struct list *list, size_t capacity)
+{
+    if ((list->names = realloc(list->names, capacity * sizeof(char *))) == NULL
+        || (list->parents = realloc(list->parents, capacity * sizeof(uint32_t))) == NULL
+        || (list->levels = realloc(list->levels, capacity * sizeof(uint16_t))) == NULL
+        || (list->flags = realloc(list->flags, capacity)) == NULL
+        || (list->walking && (list->owners = realloc(list->owners, capacity * sizeof(uint16_t))) == NULL)
+        || (list->sizing && ((list->sizes = realloc(list->sizes, capacity * sizeof(uint64_t))) == NULL
+                             || (list->blocks = realloc(list->blocks, capacity * sizeof(uint64_t))) == NULL))) {
+        fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    list->capacity = capacity;
+}
+
+/* name must outlive the list (normally it lives in list->arena); parent is
+ * a node ref while walking. Returns the new node's index. */
+size_t append_node(char *name, size_t parent, int level, int isdir, struct list *list)
+{
+    if (list->count == list->capacity)      //grow geometrically so appends stay amortized O(1)
+        resize_nodes(list, list->capacity ? list->capacity * 2 : 1024);
+    if (list->count == NO_PARENT || level > UINT16_MAX) {
+        fprintf(stderr, "%s: too many entries or levels to list\n", "dirlist");
+        exit(-1);
+    }
+    size_t i = list->count++;
+    list->names[i] = name;
+    list->levels[i] = level;
+    list->flags[i] = isdir ? NODE_DIR : 0;
+    if (list->walking) {
+        list->owners[i] = parent >> NODE_REF_SHIFT;
+        parent &= ((size_t) 1 << NODE_REF_SHIFT) - 1;
+    }
+    list->parents[i] = parent;
+    return i;
+}
+
+/* --sizes: what node takes up itself; st is NULL if it couldn't be stat()ed */
+void set_node_size(size_t node, struct stat *st, struct list *list)
+{
+    list->sizes[node] = st ? (uint64_t) st->st_size : 0;
+    list->blocks[node] = st ? (uint64_t) st->st_blocks : 0;
+}
+
+void append_dir_stat(size_t node, struct stat *st, struct list *list)
+{
+    if (list->ndirs == list->dirs_capacity) {
+        size_t capacity = list->dirs_capacity ? list->dirs_capacity * 2 : 256;
+        struct dir_stat *dirs = realloc(list->dirs, capacity * sizeof(struct dir_stat));
+        if (dirs == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        list->dirs = dirs;
+        list->dirs_capacity = capacity;
+    }
+    list->dirs[list->ndirs++] = (struct dir_stat) { node, st->st_dev, st->st_ino, st->st_mtim, st->st_ctim };
+}
+
+/* moves every node and name of src onto dst and frees src; parent and
+ * dir_stat node indices are copied as-is, so the caller must rebase them */
+void merge_lists(struct list *dst, struct list *src)
+{
+    if (dst->ndirs + src->ndirs > dst->dirs_capacity) {
+        dst->dirs_capacity = dst->ndirs + src->ndirs;
+        if ((dst->dirs = realloc(dst->dirs, dst->dirs_capacity * sizeof(struct dir_stat))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+    if (src->ndirs > 0)
+        memcpy(dst->dirs + dst->ndirs, src->dirs, src->ndirs * sizeof(struct dir_stat));
+    dst->ndirs += src->ndirs;
+    free(src->dirs);
+    if (dst->count + src->count >= NO_PARENT) {
+        fprintf(stderr, "%s: too many entries or levels to list\n", "dirlist");
+        exit(-1);
     }
+    if (dst->count + src->count > dst->capacity)
+        resize_nodes(dst, dst->count + src->count);
+    if (src->count > 0) {
+        memcpy(dst->names + dst->count, src->names, src->count * sizeof(char *));
+        memcpy(dst->parents + dst->count, src->parents, src->count * sizeof(uint32_t));
+        memcpy(dst->levels + dst->count, src->levels, src->count * sizeof(uint16_t));
+        memcpy(dst->flags + dst->count, src->flags, src->count);
+        if (dst->walking)
+            memcpy(dst->owners + dst->count, src->owners, src->count * sizeof(uint16_t));
+        if (dst->sizing) {
+            memcpy(dst->sizes + dst->count, src->sizes, src->count * sizeof(uint64_t));
+            memcpy(dst->blocks + dst->count, src->blocks, src->count * sizeof(uint64_t));
+        }
+    }
+    dst->count += src->count;
+    arena_splice(&dst->arena, &src->arena);
+    free(src->names);
+    free(src->parents);
+    free(src->levels);
+    free(src->flags);
+    free(src->owners);
+    free(src->sizes);
+    free(src->blocks);
+    free(src);
+}
+
+/* run statistics */
+
+struct stats {              //kept per worker and summed after the walk, so no atomics
+    long dirs_opened;
+    long entries_read;
+    long stat_calls;
+    long entries_filtered;  //dropped by --exclude or --include
+    long getdents_calls;
+    long readdir_calls;
+    long dirs_reused;       //--snapshot: unchanged, children taken from the snapshot
+    long dirs_rescanned;    //--snapshot: read from disk
+    long bytes_allocated;   //peak of the big structures (arena, node and sort arrays)
+    long bytes_written;
+    long runs_spilled;      //--mem-limit
+    long merge_passes;
+    long bytes_spilled;
+    long dirs_deduped;      //--follow: reached again through another path, not descended
+    long checkpoints;       //--checkpoint: written during the walk
+    double checkpoint_time; //spent with the walk paused for them
+    double compare_time;    //--verify, --diff
+    double walk_time;       //per-phase wall time; --bfs adds up each level's share
+    double sort_time;
+    double output_time;
+};
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void add_stats(struct stats *dst, struct stats *src)
+{
+    dst->dirs_opened += src->dirs_opened;
+    dst->entries_read += src->entries_read;
+    dst->stat_calls += src->stat_calls;
+    dst->entries_filtered += src->entries_filtered;
+    dst->getdents_calls += src->getdents_calls;
+    dst->readdir_calls += src->readdir_calls;
+    dst->dirs_reused += src->dirs_reused;
+    dst->dirs_rescanned += src->dirs_rescanned;
+    dst->dirs_deduped += src->dirs_deduped;
+    dst->checkpoints += src->checkpoints;
+    dst->checkpoint_time += src->checkpoint_time;
+    dst->bytes_allocated += src->bytes_allocated;
+    dst->bytes_written += src->bytes_written;
+}
+
+/* directory readers */
+
+enum reader_kind {
+    READER_READDIR,         //libc readdir() on an fdopendir() stream
+    READER_GETDENTS,        //raw getdents64 into a large per-worker buffer
+};
+
+#define DENTS_BUFSIZE (1 << 20)
+
+struct linux_dirent64 {     //record layout returned by getdents64
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_reader {
+    int fd;
+    DIR *ds;                //readdir backend only
+    char *buf;              //getdents backend: caller-supplied, records are parsed in place
+    size_t bufsize;
+    long pos;
+    long len;
+    struct stats *stats;
+};
+
+struct dir_entry {
+    const char *name;       //points into the reader's buffer; valid until the next read
+    unsigned char type;
+    uint64_t ino;
+};
+
+/* takes ownership of fd; buf is only used by the getdents backend */
+int open_reader(struct dir_reader *r, int fd, enum reader_kind kind, char *buf, size_t bufsize, struct stats *stats)
+{
+    r->fd = fd;
+    r->ds = NULL;
+    r->buf = buf;
+    r->bufsize = bufsize;
+    r->pos = r->len = 0;
+    r->stats = stats;
+    if (kind == READER_READDIR && (r->ds = fdopendir(fd)) == NULL)
+        return -1;
+    return 0;
 }
 
-void populate_list(char *path, struct list *list)
+int next_entry(struct dir_reader *r, struct dir_entry *e)
 {
-    static int current_level = 1;
-    if (current_level == 1) {
-        insert_sorted(create_node(path, current_level), list);
-        current_level++;
+    if (r->ds != NULL) {
+        r->stats->readdir_calls++;
+        struct dirent *d = readdir(r->ds);
+        if (d == NULL)
+            return 0;
+        e->name = d->d_name;
+        e->type = d->d_type;
+        e->ino = d->d_ino;
+        return 1;
     }
-    DIR *ds = opendir(path);
-    char tmp[255];
-    struct dirent *d;
+    if (r->pos >= r->len) {
+        r->stats->getdents_calls++;
+        r->len = syscall(SYS_getdents64, r->fd, r->buf, r->bufsize);
+        r->pos = 0;
+        if (r->len <= 0)    //end of directory, or an error we treat as one
+            return 0;
+    }
+    struct linux_dirent64 *d = (struct linux_dirent64 *) (r->buf + r->pos);
+    r->pos += d->d_reclen;
+    e->name = d->d_name;
+    e->type = d->d_type;
+    e->ino = d->d_ino;
+    return 1;
+}
+
+/* trusts d_type; only a filesystem that leaves it DT_UNKNOWN costs a stat,
+ * and that one doesn't follow links */
+int entry_is_dir(int dfd, struct dir_entry *d, struct stats *stats)
+{
     struct stat buf;
-    while ((d = readdir(ds)) != NULL) {
-        if (d->d_name[0] == '.')    //if hidden file, continue
-            continue;
-        
-        /* create a temporary string containing {PATH}/{DIRECTORY NAME} */
-        strcpy(tmp, path);
-        strcat(tmp, "/");
-        strcat(tmp, d->d_name);
-        
-        stat(tmp, &buf);            //populate buf with file information
-        insert_sorted(create_node(tmp, current_level), list);
-        if (S_ISDIR(buf.st_mode)) {
-            current_level++;
-            populate_list(tmp, list);
-            current_level--;
+    if (d->type != DT_UNKNOWN)
+        return d->type == DT_DIR;
+    stats->stat_calls++;
+    return fstatat(dfd, d->name, &buf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(buf.st_mode);
+}
+
+/* traversal filters */
+
+/* --max-depth, --exclude and --include are applied as entries are read, so
+ * an excluded directory or one below the depth limit is never opened.
+ * Globs are fnmatch() patterns matched against entry names, not paths. */
+
+struct filter {
+    int max_level;          //deepest level listed; 0 for no limit
+    char **exclude;         //entries matching one of these are skipped, subtree and all
+    size_t nexclude;
+    char **include;         //if any, only files matching one of these are listed
+    size_t ninclude;
+};
+
+/* whether an entry is listed (and, for a directory, descended into) */
+int filter_entry(struct filter *f, const char *name, int isdir, struct stats *stats)
+{
+    for (size_t i = 0; i < f->nexclude; i++) {
+        if (fnmatch(f->exclude[i], name, 0) == 0) {
+            stats->entries_filtered++;
+            return 0;
         }
     }
-    closedir(ds);
+    if (isdir || f->ninclude == 0)      //directories stay, so files below them can match
+        return 1;
+    for (size_t i = 0; i < f->ninclude; i++)
+        if (fnmatch(f->include[i], name, 0) == 0)
+            return 1;
+    stats->entries_filtered++;
+    return 0;
 }
 
-//deletions
+/* whether a directory at level is read under --max-depth */
+int filter_descends(struct filter *f, int level)
+{
+    return f->max_level == 0 || level < f->max_level;
+}
 
-void destroy_list(struct list *list)
+/* directory snapshots */
+
+/* --snapshot FILE keeps, for every directory listed, its device, inode,
+ * mtime and ctime together with its visible children. On the next run a
+ * directory whose stat still matches isn't read at all: its children come
+ * from the snapshot (names point straight into the mapping) and only its
+ * subdirectories are checked in turn.
+ *
+ * Layout, native endian: header, dirs[ndirs], children[nchildren], string
+ * pool. Each directory's children are contiguous and sorted by name. */
+
+#define SNAP_MAGIC "DLSNAP1"
+#define SNAP_NONE UINT64_MAX            //child isn't a directory / no record
+#define SNAP_UNREAD (UINT64_MAX - 1)    //child is a directory that couldn't be read
+
+struct snap_header {
+    char magic[8];
+    uint64_t ndirs;
+    uint64_t nchildren;
+    uint64_t pool_size;
+    uint64_t root_path;     //pool offset of the path the snapshot was taken from
+    uint64_t root_dir;
+};
+
+struct snap_dir {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t first_child;
+    uint64_t nchildren;
+};
+
+struct snap_child {
+    uint64_t name;          //pool offset
+    uint64_t dir;           //index into dirs, SNAP_NONE or SNAP_UNREAD
+};
+
+struct snapshot {
+    void *map;
+    size_t size;
+    struct snap_header *header;
+    struct snap_dir *dirs;
+    struct snap_child *children;
+    char *pool;
+};
+
+/* maps filename and checks it was taken from root; returns 0 if usable */
+int load_snapshot(struct snapshot *snap, char *filename, char *root)
 {
-    struct node *curr = list->head, *tmp;
-    while (curr != NULL) {
-        free(curr->path);
-        tmp = curr;
-        curr = curr->next;
-        free(tmp);
+    memset(snap, 0, sizeof(struct snapshot));
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "%s: couldn't open snapshot %s; %s\n", "dirlist", filename, strerror(errno));
+        return -1;
     }
-    free(list);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct snap_header)) {
+        fprintf(stderr, "%s: ignoring snapshot %s; too short\n", "dirlist", filename);
+        close(fd);
+        return -1;
+    }
+    snap->size = st.st_size;
+    snap->map = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap->map == MAP_FAILED) {
+        fprintf(stderr, "%s: couldn't map snapshot %s; %s\n", "dirlist", filename, strerror(errno));
+        snap->map = NULL;
+        return -1;
+    }
+    struct snap_header *h = snap->header = snap->map;
+    snap->dirs = (struct snap_dir *) (h + 1);
+    snap->children = (struct snap_child *) (snap->dirs + h->ndirs);
+    snap->pool = (char *) (snap->children + h->nchildren);
+    int ok = memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) == 0
+             && h->ndirs < snap->size / sizeof(struct snap_dir)
+             && h->nchildren < snap->size / sizeof(struct snap_child)
+             && sizeof(struct snap_header) + h->ndirs * sizeof(struct snap_dir)
+                + h->nchildren * sizeof(struct snap_child) + h->pool_size == snap->size
+             && h->pool_size > 0 && snap->pool[h->pool_size - 1] == '\0'
+             && h->root_path < h->pool_size && h->root_dir < h->ndirs;
+    for (uint64_t i = 0; ok && i < h->ndirs; i++)
+        ok = snap->dirs[i].first_child <= h->nchildren
+             && snap->dirs[i].nchildren <= h->nchildren - snap->dirs[i].first_child;
+    for (uint64_t i = 0; ok && i < h->nchildren; i++)
+        ok = snap->children[i].name < h->pool_size
+             && (snap->children[i].dir < h->ndirs || snap->children[i].dir >= SNAP_UNREAD);
+    if (!ok) {
+        fprintf(stderr, "%s: ignoring snapshot %s; not a valid snapshot\n", "dirlist", filename);
+    } else if (strcmp(snap->pool + h->root_path, root) != 0) {
+        fprintf(stderr, "%s: ignoring snapshot %s; it lists %s\n", "dirlist", filename, snap->pool + h->root_path);
+        ok = 0;
+    }
+    if (!ok) {
+        munmap(snap->map, snap->size);
+        snap->map = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-//prints
+void unload_snapshot(struct snapshot *snap)
+{
+    if (snap->map != NULL)
+        munmap(snap->map, snap->size);
+    snap->map = NULL;
+}
 
-void print_list_to_file(struct list *list, char *filename)
+int snap_matches(struct snap_dir *d, struct stat *st)
 {
-    int order;
-    struct node *curr = list->head;
-    FILE *fs = fopen(filename, "w");
-    while (curr != NULL) {
-        if (curr->prev != NULL && curr->level == curr->prev->level)
-            order++;
+    return d->dev == (uint64_t) st->st_dev && d->ino == (uint64_t) st->st_ino
+           && d->mtime_sec == st->st_mtim.tv_sec && d->mtime_nsec == st->st_mtim.tv_nsec
+           && d->ctime_sec == st->st_ctim.tv_sec && d->ctime_nsec == st->st_ctim.tv_nsec;
+}
+
+/* record for the subdirectory name of snapshot directory dir, if any */
+uint64_t find_snap_child(struct snapshot *snap, uint64_t dir, const char *name)
+{
+    if (dir >= snap->header->ndirs)
+        return SNAP_NONE;
+    struct snap_child *c = snap->children + snap->dirs[dir].first_child;
+    size_t lo = 0, hi = snap->dirs[dir].nchildren;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(snap->pool + c[mid].name, name);
+        if (cmp == 0)
+            return c[mid].dir == SNAP_UNREAD ? SNAP_NONE : c[mid].dir;
+        if (cmp < 0)
+            lo = mid + 1;
         else
-            order = 1;
-        fprintf(fs, "%d:%d:%s\n", curr->level, order, curr->path);
-        curr = curr->next;
+            hi = mid;
     }
-    fclose(fs);
+    return SNAP_NONE;
 }
 
-void insertion_sort_by_level_increasing(struct list *list)
+int compare_siblings(const void *a, const void *b, void *arg)
 {
-    struct node *fi = list->head->next, *bi, *tmp;
-    int key;
-    while (fi != NULL) {
-        key = fi->level;
-        bi = fi->prev;
-        tmp = fi;
-        fi = fi->next;
-        while (bi != list->head && bi->level > key)
-            bi = bi->prev;
+    struct list *list = arg;
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+    if (list->parents[x] != list->parents[y])
+        return list->parents[x] < list->parents[y] ? -1 : 1;
+    return strcmp(list->names[x], list->names[y]);
+}
+
+/* writes list (with its dir_stats) to filename via a temporary and a rename */
+void save_snapshot(struct list *list, char *filename)
+{
+    size_t n = list->count;
+    size_t *byparent = malloc(n * sizeof(size_t));
+    uint64_t *dir_of = malloc(n * sizeof(uint64_t));
+    struct snap_dir *dirs = calloc(list->ndirs + 1, sizeof(struct snap_dir));
+    struct snap_child *children = malloc(n * sizeof(struct snap_child));
+    size_t tmplen = strlen(filename) + 5;
+    char *tmp = malloc(tmplen);
+    if (byparent == NULL || dir_of == NULL || dirs == NULL || children == NULL || tmp == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for snapshot; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    struct snap_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.ndirs = list->ndirs;
+    h.root_dir = SNAP_NONE;
+    for (size_t i = 0; i < n; i++)
+        dir_of[i] = (list->flags[i] & NODE_DIR) ? SNAP_UNREAD : SNAP_NONE;
+    for (size_t k = 0; k < list->ndirs; k++) {
+        struct dir_stat *ds = &list->dirs[k];
+        dir_of[ds->node] = k;
+        dirs[k] = (struct snap_dir) { ds->dev, ds->ino, ds->mtime.tv_sec, ds->mtime.tv_nsec,
+                                      ds->ctime.tv_sec, ds->ctime.tv_nsec, 0, 0 };
+        if (list->parents[ds->node] == NO_PARENT)
+            h.root_dir = k;
+    }
+    if (h.root_dir == SNAP_NONE) {      //root couldn't be read; nothing worth keeping
+        fprintf(stderr, "%s: not writing snapshot %s; the root wasn't read\n", "dirlist", filename);
+        free(byparent), free(dir_of), free(dirs), free(children), free(tmp);
+        return;
+    }
+
+    //group children under their parents, by name
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++)
+        if (list->parents[i] != NO_PARENT)
+            byparent[m++] = i;
+    qsort_r(byparent, m, sizeof(size_t), compare_siblings, list);
+    h.nchildren = m;
+    h.pool_size = 0;
+    for (size_t j = 0; j < m; j++) {
+        size_t parent = list->parents[byparent[j]];
+        uint64_t pdir = dir_of[parent];
+        if (j == 0 || list->parents[byparent[j - 1]] != parent)
+            dirs[pdir].first_child = j;
+        dirs[pdir].nchildren++;
+        children[j] = (struct snap_child) { h.pool_size, dir_of[byparent[j]] };
+        h.pool_size += strlen(list->names[byparent[j]]) + 1;
+    }
+    h.root_path = h.pool_size;
+    h.pool_size += strlen(list->names[0]) + 1;
 
-        //remove tmp and place it after bi 
-        if (tmp->next != NULL)
-            tmp->next->prev = tmp->prev;
-        tmp->prev->next = tmp->next;
-        tmp->next = bi->next;
-        tmp->prev = bi;
-        if (bi->next != NULL)
-            bi->next->prev = tmp;
-        bi->next = tmp;
+    snprintf(tmp, tmplen, "%s.tmp", filename);
+    FILE *fs = fopen(tmp, "w");
+    if (fs == NULL) {
+        fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", tmp, strerror(errno));
+        exit(-1);
+    }
+    fwrite(&h, sizeof(h), 1, fs);
+    fwrite(dirs, sizeof(struct snap_dir), h.ndirs, fs);
+    fwrite(children, sizeof(struct snap_child), m, fs);
+    for (size_t j = 0; j < m; j++)
+        fwrite(list->names[byparent[j]], 1, strlen(list->names[byparent[j]]) + 1, fs);
+    fwrite(list->names[0], 1, strlen(list->names[0]) + 1, fs);
+    if (ferror(fs) | fclose(fs) || rename(tmp, filename) < 0) {
+        fprintf(stderr, "%s: couldn't write snapshot %s; %s\n", "dirlist", filename, strerror(errno));
+        exit(-1);
     }
+    free(byparent);
+    free(dir_of);
+    free(dirs);
+    free(children);
+    free(tmp);
 }
 
-/* main */
+/* work-stealing directory walker */
 
-int main(int argc, char **argv)
+struct dir_handle {         //an open directory kept alive while its subdirectories are queued
+    struct dir_reader reader;
+    atomic_int refs;
+};
+
+struct dir_item {
+    char *name;             //lives in the arena of the worker that found it
+    size_t node;            //the directory's node, tagged with that worker (see node_ref)
+    struct dir_handle *parent;  //NULL for the root, which is opened by name
+    int level;              //level of the entries found inside it
+    uint64_t snap;          //its record in the previous snapshot, or SNAP_NONE
+};
+
+struct deque {              //ring buffer; owner works the tail, thieves take the head
+    struct dir_item *items;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+struct walker;
+
+struct inode_entry {
+    uint64_t ino;
+    size_t name;            //offset into the worker's batch_names
+    unsigned char type;
+};
+
+struct worker {
+    struct walker *walker;
+    struct deque deque;
+    struct list *list;      //entries found by this worker, merged after the walk
+    char *dents;            //getdents64 buffer, reused for every directory this worker reads
+    struct inode_entry *batch;  //--inode-order: the directory being read, names in batch_names
+    size_t batch_capacity;
+    char *batch_names;
+    size_t batch_names_size;
+    struct stats stats;
+    unsigned int seed;      //victim selection for steals
+    int id;
+    pthread_t tid;
+};
+
+struct walk_options {
+    int nthreads;
+    enum reader_kind reader;
+    int bfs;                //stream level by level instead of walk-then-sort
+    char *snapshot_file;    //record dir_stats for a new snapshot
+    struct snapshot *snapshot;  //previous snapshot to reuse, or NULL
+    size_t mem_limit;       //spill sorted runs to disk beyond this many bytes; 0 for no limit
+    char *index_file;       //also write a binary index of the sorted list
+    struct filter filter;
+    int inode_order;        //stat and descend in d_ino order within each directory
+    int follow;             //descend symlinked directories, each physical one once (--bfs only)
+    char *sizes_file;       //stat every entry and write per-directory totals here
+    char *checkpoint_file;  //save the walk's progress here now and then
+    double checkpoint_interval;     //seconds between checkpoints
+    int resume;             //start from checkpoint_file rather than the roots
+};
+
+struct walker {
+    struct worker *workers;
+    int nworkers;
+    struct walk_options *options;
+    atomic_long pending;    //directories queued or being scanned; 0 means done
+    atomic_int pausing;     //--checkpoint: worker 0 wants the others parked
+    atomic_int parked;
+    double next_checkpoint;
+    char **root_paths;      //--checkpoint: absolute, so --resume works from any directory
+};
+
+void push_item(struct deque *dq, struct dir_item item)
 {
-    if (argc != 3) {
-        printf("usage: dirlist directory_path file_name\n");
-        return -1;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->capacity) {
+        size_t capacity = dq->capacity ? dq->capacity * 2 : 64;
+        struct dir_item *items = malloc(capacity * sizeof(struct dir_item));
+        if (items == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        for (size_t i = 0; i < dq->count; i++)      //unwrap into the new buffer
+            items[i] = dq->items[(dq->head + i) % dq->capacity];
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->capacity = capacity;
+    }
+    dq->items[(dq->head + dq->count) % dq->capacity] = item;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+int pop_item(struct deque *dq, struct dir_item *item)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        *item = dq->items[(dq->head + dq->count) % dq->capacity];
+        found = 1;
     }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
 
-    char *dirpath = argv[1], *outfile = argv[2];
-    struct list *dirlist = create_list();
-    populate_list(dirpath, dirlist);
-    insertion_sort_by_level_increasing(dirlist);
-    print_list_to_file(dirlist, outfile);    
-    destroy_list(dirlist);
+/* reverses the newest n items, so the owner pops them in the order they were pushed */
+void reverse_newest(struct deque *dq, size_t n)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (n > dq->count)      //thieves took some
+        n = dq->count;
+    for (size_t i = 0, j = n - 1; i < n / 2; i++, j--) {
+        struct dir_item *a = &dq->items[(dq->head + dq->count - 1 - i) % dq->capacity];
+        struct dir_item *b = &dq->items[(dq->head + dq->count - 1 - j) % dq->capacity];
+        struct dir_item tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+    pthread_mutex_unlock(&dq->lock);
+}
+
+int steal_item(struct deque *dq, struct dir_item *item)
+{
+    int found = 0;
+    if (pthread_mutex_trylock(&dq->lock) != 0)      //busy victim; try someone else
+        return 0;
+    if (dq->count > 0) {
+        *item = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+void release_handle(struct dir_handle *handle)
+{
+    if (handle != NULL && atomic_fetch_sub(&handle->refs, 1) == 1) {
+        if (handle->reader.ds != NULL)
+            closedir(handle->reader.ds);
+        else
+            close(handle->reader.fd);
+        free(handle);
+    }
+}
+
+/* opens the directory path like open(), even when it is longer than
+ * PATH_MAX: such a path is opened a stretch of whole components at a time,
+ * each relative to the last */
+int open_dir_path(const char *path)
+{
+    size_t len = strlen(path);
+    if (len < PATH_MAX)
+        return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    memcpy(buf, path, len + 1);
+    int fd = AT_FDCWD;
+    char *rest = buf;
+    while (fd != -1 && strlen(rest) >= PATH_MAX) {
+        char *cut = rest + PATH_MAX - 1;
+        while (cut > rest && *cut != '/')
+            cut--;
+        int next = -1;
+        if (cut == rest) {      //one component can't be this long
+            errno = ENAMETOOLONG;
+        } else {
+            *cut = '\0';
+            next = openat(fd, rest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            rest = cut + 1;
+            while (*rest == '/')    //a root given with a trailing slash
+                rest++;
+        }
+        if (fd != AT_FDCWD)
+            close(fd);
+        fd = next;
+    }
+    int result = fd == -1 ? -1 : openat(fd, rest, O_RDONLY | O_DIRECTORY | O_CLOEXEC), err = errno;
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    errno = err;
+    return result;
+}
+
+/* every directory with queued children holds an fd; lift the soft limit
+ * as far as we're allowed so wide frontiers don't run out. Returns the
+ * limit now in force. */
+long raise_fd_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        return 1024;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > LONG_MAX ? LONG_MAX : (long) rl.rlim_cur;
+}
+
+/* opens item relative to its parent's fd, so the kernel resolves one
+ * component instead of the whole path */
+int open_item(struct dir_item *item)
+{
+    int fd = item->parent ? openat(item->parent->reader.fd, item->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                          : open_dir_path(item->name);
+    if (fd < 0) {           //only full paths are useful in the message; recover the parent's from procfs
+        int err = errno;
+        char link[64], dir[4096] = "...";
+        ssize_t len = -1;
+        if (item->parent) {
+            snprintf(link, sizeof(link), "/proc/self/fd/%d", item->parent->reader.fd);
+            len = readlink(link, dir, sizeof(dir) - 1);
+        }
+        dir[len > 0 ? len : 3] = '\0';
+        fprintf(stderr, "%s: couldn't open %s%s%s; %s\n", "dirlist", item->parent ? dir : "",
+                item->parent ? "/" : "", item->name, strerror(err));
+    }
+    release_handle(item->parent);
+    item->parent = NULL;
+    return fd;
+}
+
+/* the directory is unchanged since the snapshot: list its children from
+ * there and queue its subdirectories without reading it */
+void reuse_directory(struct worker *self, struct dir_item *item, struct dir_handle *handle)
+{
+    struct snapshot *snap = self->walker->options->snapshot;
+    struct snap_dir *dir = &snap->dirs[item->snap];
+    self->stats.dirs_reused++;
+    for (uint64_t j = 0; j < dir->nchildren; j++) {
+        struct snap_child *c = &snap->children[dir->first_child + j];
+        char *name = snap->pool + c->name;
+        size_t index = append_node(name, item->node, item->level, c->dir != SNAP_NONE, self->list);
+        if (c->dir != SNAP_NONE) {
+            atomic_fetch_add(&handle->refs, 1);
+            atomic_fetch_add(&self->walker->pending, 1);
+            push_item(&self->deque, (struct dir_item) { name, node_ref(self->id, index), handle, item->level + 1,
+                                                        c->dir == SNAP_UNREAD ? SNAP_NONE : c->dir });
+        }
+    }
+}
+
+/* lists an entry read from item's directory, queueing it if it's a
+ * directory to descend into; returns 1 if it was queued */
+int add_scanned(struct worker *self, struct dir_item *item, struct dir_handle *handle, struct dir_entry *d, int descend)
+{
+    struct walk_options *options = self->walker->options;
+    struct snapshot *snap = options->snapshot;
+    struct stat st;
+    int stated = 0, isdir;
+    if (self->list->sizing) {       //the stat d_type saves is needed anyway
+        self->stats.stat_calls++;
+        stated = fstatat(handle->reader.fd, d->name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+    isdir = stated ? S_ISDIR(st.st_mode) : entry_is_dir(handle->reader.fd, d, &self->stats);
+    if (!filter_entry(&options->filter, d->name, isdir, &self->stats))
+        return 0;
+    char *name = arena_strdup(&self->list->arena, d->name);
+    size_t index = append_node(name, item->node, item->level, isdir, self->list);
+    if (self->list->sizing)
+        set_node_size(index, stated ? &st : NULL, self->list);
+    if (isdir && descend) {
+        uint64_t child = snap != NULL && item->snap != SNAP_NONE ? find_snap_child(snap, item->snap, name) : SNAP_NONE;
+        atomic_fetch_add(&handle->refs, 1);
+        atomic_fetch_add(&self->walker->pending, 1);
+        push_item(&self->deque, (struct dir_item) { name, node_ref(self->id, index), handle, item->level + 1, child });
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int compare_inodes(const void *a, const void *b)
+{
+    uint64_t x = ((const struct inode_entry *) a)->ino, y = ((const struct inode_entry *) b)->ino;
+    return x < y ? -1 : x > y;
+}
+
+/* --inode-order: reads the whole directory first and handles its entries by
+ * d_ino, which on most filesystems is close to where their inodes sit on
+ * disk. Any stat then goes in that order, and so does the descent: the
+ * subdirectories are queued so the owner pops the lowest inode first. */
+void scan_inode_order(struct worker *self, struct dir_item *item, struct dir_handle *handle, int descend)
+{
+    struct dir_entry d;
+    size_t n = 0, names = 0, queued = 0;
+    posix_fadvise(handle->reader.fd, 0, 0, POSIX_FADV_WILLNEED);    //a hint; most filesystems ignore it for directories
+    while (next_entry(&handle->reader, &d)) {
+        self->stats.entries_read++;
+        if (d.name[0] == '.')       //if hidden file, continue
+            continue;
+        size_t len = strlen(d.name) + 1;
+        self->batch = grow_array(self->batch, &self->batch_capacity, n + 1, sizeof(struct inode_entry));
+        self->batch_names = grow_array(self->batch_names, &self->batch_names_size, names + len, 1);
+        memcpy(self->batch_names + names, d.name, len);
+        self->batch[n++] = (struct inode_entry) { d.ino, names, d.type };
+        names += len;
+    }
+    qsort(self->batch, n, sizeof(struct inode_entry), compare_inodes);
+    for (size_t i = 0; i < n; i++) {
+        d = (struct dir_entry) { self->batch_names + self->batch[i].name, self->batch[i].type, self->batch[i].ino };
+        queued += add_scanned(self, item, handle, &d, descend);
+    }
+    reverse_newest(&self->deque, queued);
+}
+
+void scan_directory(struct worker *self, struct dir_item *item)
+{
+    struct dir_handle *handle = malloc(sizeof(struct dir_handle));
+    if (handle == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    int fd = open_item(item);
+    if (fd < 0) {
+        free(handle);
+        return;
+    }
+    if (open_reader(&handle->reader, fd, self->walker->options->reader, self->dents, DENTS_BUFSIZE, &self->stats) < 0) {
+        fprintf(stderr, "%s: couldn't read %s; %s\n", "dirlist", item->name, strerror(errno));
+        close(fd);
+        free(handle);
+        return;
+    }
+    self->stats.dirs_opened++;
+    atomic_init(&handle->refs, 1);      //held by this scan until the last entry is read
+
+    struct walk_options *options = self->walker->options;
+    struct snapshot *snap = options->snapshot;
+    if (options->snapshot_file != NULL) {
+        struct stat st;
+        self->stats.stat_calls++;
+        if (fstat(fd, &st) == 0) {
+            append_dir_stat(item->node, &st, self->list);
+            if (snap != NULL && item->snap != SNAP_NONE && snap_matches(&snap->dirs[item->snap], &st)) {
+                reuse_directory(self, item, handle);
+                release_handle(handle);
+                return;
+            }
+        }
+        self->stats.dirs_rescanned++;
+    }
+
+    struct dir_entry d;
+    int descend = filter_descends(&options->filter, item->level);
+    if (options->inode_order) {
+        scan_inode_order(self, item, handle, descend);
+        release_handle(handle);
+        return;
+    }
+    while (next_entry(&handle->reader, &d)) {
+        self->stats.entries_read++;
+        if (d.name[0] == '.')       //if hidden file, continue
+            continue;
+        add_scanned(self, item, handle, &d, descend);
+    }
+    release_handle(handle);
+}
+
+/* waits a little longer each time a thread finds nothing to do */
+void backoff(int *idle)
+{
+    if (++*idle > 64)
+        usleep(50);
+    else
+        sched_yield();
+}
+
+/* checkpoints */
+
+/* --checkpoint FILE makes a long walk restartable. Every
+ * --checkpoint-interval seconds, and on SIGINT or SIGTERM, worker 0 has the
+ * others park between two directories and writes out every node found so
+ * far plus the directories still queued. That is a consistent cut: a
+ * queued directory has none of its entries listed yet. The file is
+ * replaced through a temporary and a rename, so dying halfway through a
+ * write leaves the previous checkpoint intact. --resume loads it into the
+ * empty list, reopens the saved frontier a component at a time from the
+ * roots and walks on, so the sort sees the same nodes an uninterrupted run
+ * would have found. Whatever was read after the last checkpoint is read
+ * again. The file is removed once the output is written.
+ *
+ * Layout, native endian: header, nodes[nnodes], frontier[nfrontier], string
+ * pool to the end of the file. Nodes are numbered as they will be after
+ * the merge, so the roots are still nodes 0 to nroots - 1. The pool ends
+ * with the absolute path of each root, so a relative root is found again
+ * from another working directory. */
+
+#define CKPT_MAGIC "DLCKPT2"
+
+struct ckpt_header {
+    char magic[8];
+    uint64_t nroots;
+    uint64_t nnodes;
+    uint64_t nfrontier;
+    uint64_t sizing;        //whether nodes carry --sizes columns
+    uint64_t roots;         //pool offset of the roots' absolute paths, one after another
+};
+
+struct ckpt_node {
+    uint64_t name;          //pool offset
+    uint64_t size;          //--sizes only
+    uint64_t blocks;
+    uint32_t parent;        //node index, or NO_PARENT
+    uint16_t level;
+    uint8_t flags;
+    uint8_t pad;
+};
+
+struct ckpt_dir {           //a directory that was queued but not read
+    uint32_t node;
+    uint32_t level;         //of its entries
+};
+
+volatile sig_atomic_t walk_stop = 0;
+
+void stop_walking(int sig)
+{
+    (void) sig;
+    walk_stop = 1;
+}
+
+/* with every other worker parked */
+void write_checkpoint(struct walker *walker)
+{
+    struct walk_options *options = walker->options;
+    size_t *base = malloc(walker->nworkers * sizeof(size_t)), total = 0;
+    size_t tmplen = strlen(options->checkpoint_file) + 5;
+    char *tmp = malloc(tmplen);
+    if (base == NULL || tmp == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for checkpoint; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    struct ckpt_header h = { CKPT_MAGIC, 0, 0, 0, walker->workers[0].list->sizing, 0 };
+    for (int w = 0; w < walker->nworkers; w++) {
+        struct list *list = walker->workers[w].list;
+        base[w] = total;
+        total += list->count;
+        h.nfrontier += walker->workers[w].deque.count;
+        for (size_t i = 0; i < list->count; i++)
+            h.roots += strlen(list->names[i]) + 1;
+    }
+    for (h.nroots = 0; h.nroots < walker->workers[0].list->count; h.nroots++)
+        if (walker->workers[0].list->parents[h.nroots] != NO_PARENT)
+            break;
+    h.nnodes = total;
+
+    snprintf(tmp, tmplen, "%s.tmp", options->checkpoint_file);
+    struct writer w;
+    open_writer(&w, create_output(tmp), 0, 0);
+    write_bytes(&w, &h, sizeof(h));
+    uint64_t name = 0;
+    for (int k = 0; k < walker->nworkers; k++) {
+        struct list *list = walker->workers[k].list;
+        for (size_t i = 0; i < list->count; i++) {
+            struct ckpt_node n = { name, list->sizing ? list->sizes[i] : 0, list->sizing ? list->blocks[i] : 0,
+                                   list->parents[i] == NO_PARENT ? NO_PARENT : base[list->owners[i]] + list->parents[i],
+                                   list->levels[i], list->flags[i], 0 };
+            write_bytes(&w, &n, sizeof(n));
+            name += strlen(list->names[i]) + 1;
+        }
+    }
+    for (int k = 0; k < walker->nworkers; k++) {
+        struct deque *dq = &walker->workers[k].deque;
+        for (size_t i = 0; i < dq->count; i++) {
+            struct dir_item *item = &dq->items[(dq->head + i) % dq->capacity];
+            size_t ref = item->node;
+            struct ckpt_dir d = { base[ref >> NODE_REF_SHIFT] + (ref & (((size_t) 1 << NODE_REF_SHIFT) - 1)), item->level };
+            write_bytes(&w, &d, sizeof(d));
+        }
+    }
+    for (int k = 0; k < walker->nworkers; k++) {
+        struct list *list = walker->workers[k].list;
+        for (size_t i = 0; i < list->count; i++)
+            write_bytes(&w, list->names[i], strlen(list->names[i]) + 1);
+    }
+    for (uint64_t r = 0; r < h.nroots; r++)
+        write_bytes(&w, walker->root_paths[r], strlen(walker->root_paths[r]) + 1);
+    close_writer(&w);
+    if (fsync(w.fd) < 0 || close(w.fd) < 0 || rename(tmp, options->checkpoint_file) < 0) {
+        fprintf(stderr, "%s: couldn't write checkpoint %s; %s\n", "dirlist", options->checkpoint_file, strerror(errno));
+        exit(-1);
+    }
+    free(base);
+    free(tmp);
+}
+
+/* worker 0, between two directories: parks the others, writes a
+ * checkpoint and lets them go again */
+void checkpoint_walk(struct worker *self)
+{
+    struct walker *walker = self->walker;
+    double mark = now();
+    int idle = 0;
+    atomic_store(&walker->pausing, 1);
+    while (atomic_load(&walker->parked) < walker->nworkers - 1 && atomic_load(&walker->pending) > 0)
+        backoff(&idle);
+    if (atomic_load(&walker->pending) > 0) {    //else the walk just ended and the others are leaving
+        write_checkpoint(walker);
+        self->stats.checkpoints++;
+    }
+    if (walk_stop) {
+        fprintf(stderr, "%s: interrupted; checkpoint in %s, rerun with --resume to continue\n", "dirlist",
+                walker->options->checkpoint_file);
+        exit(-1);
+    }
+    atomic_store(&walker->pausing, 0);
+    while (atomic_load(&walker->parked) > 0)   //all out before the next pause can count them
+        backoff(&idle);
+    self->stats.checkpoint_time += now() - mark;
+    walker->next_checkpoint = now() + walker->options->checkpoint_interval;
+}
+
+struct dir_handle unopenable;   //resume_handle() tried that directory and failed
+
+/* a handle on node's directory, opened relative to its parent's, which is
+ * opened the same way up to a root; memoized in handles[], where each
+ * holds a reference of its own. NULL, with a message, if it can't be. */
+struct dir_handle *resume_handle(struct list *list, size_t node, char **roots, struct dir_handle **handles)
+{
+    if (handles[node] != NULL)
+        return handles[node] == &unopenable ? NULL : handles[node];
+    struct dir_handle *parent = NULL;
+    if (list->parents[node] != NO_PARENT && (parent = resume_handle(list, list->parents[node], roots, handles)) == NULL) {
+        handles[node] = &unopenable;
+        return NULL;
+    }
+    struct dir_handle *handle = malloc(sizeof(struct dir_handle));
+    if (handle == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    if (parent != NULL)
+        atomic_fetch_add(&parent->refs, 1);     //open_item() drops it
+    struct dir_item item = { parent ? list->names[node] : roots[node], node, parent, 0, SNAP_NONE };
+    memset(&handle->reader, 0, sizeof(handle->reader));
+    if ((handle->reader.fd = open_item(&item)) < 0) {
+        free(handle);
+        handles[node] = &unopenable;
+        return NULL;
+    }
+    atomic_init(&handle->refs, 1);
+    return handles[node] = handle;
+}
+
+/* the nodes and frontier of options->checkpoint_file into worker 0's empty
+ * list and deques; returns the number of directories queued, or -1 if there
+ * is no checkpoint, as after a run that finished */
+long load_checkpoint(struct walker *walker, char **paths, int npaths)
+{
+    char *filename = walker->options->checkpoint_file;
+    struct list *list = walker->workers[0].list;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 && errno == ENOENT) {
+        fprintf(stderr, "%s: no checkpoint in %s; starting from the top\n", "dirlist", filename);
+        return -1;
+    }
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "%s: couldn't open checkpoint %s; %s\n", "dirlist", filename, strerror(errno));
+        exit(-1);
+    }
+    size_t size = st.st_size;
+    void *map = size >= sizeof(struct ckpt_header) ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    struct ckpt_header *h = map;
+    struct ckpt_node *nodes = (struct ckpt_node *) (h + 1);
+    struct ckpt_dir *frontier = (struct ckpt_dir *) (nodes + (map != MAP_FAILED ? h->nnodes : 0));
+    char *pool = (char *) (frontier + (map != MAP_FAILED ? h->nfrontier : 0));
+    size_t pool_size = map != MAP_FAILED ? size - (pool - (char *) map) : 0;
+    int ok = map != MAP_FAILED && memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) == 0
+             && h->nnodes < NO_PARENT && h->nfrontier < NO_PARENT
+             && sizeof(struct ckpt_header) + h->nnodes * sizeof(struct ckpt_node)
+                + h->nfrontier * sizeof(struct ckpt_dir) < size
+             && pool[pool_size - 1] == '\0' && h->nroots == (uint64_t) npaths && h->nroots <= h->nnodes
+             && h->sizing == (uint64_t) list->sizing;
+    char **roots = ok ? malloc(h->nroots * sizeof(char *)) : NULL;
+    if (ok && roots == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for checkpoint; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (uint64_t i = 0, at = ok ? h->roots : 0; ok && i < h->nroots; at += strlen(pool + at) + 1, i++)
+        if ((ok = at < pool_size && pool[at] == '/'))
+            roots[i] = pool + at;
+    for (uint64_t i = 0; ok && i < h->nnodes; i++) {     //every parent chain must end at a root
+        struct ckpt_node *n = &nodes[i];
+        ok = n->name < pool_size && (i < h->nroots ? n->parent == NO_PARENT && n->level == 1
+                                                     && strcmp(pool + n->name, paths[i]) == 0
+                                                   : n->parent < h->nnodes && nodes[n->parent].level + 1 == n->level);
+    }
+    for (uint64_t i = 0; ok && i < h->nfrontier; i++)
+        ok = frontier[i].node < h->nnodes && (nodes[frontier[i].node].flags & NODE_DIR)
+             && frontier[i].level == nodes[frontier[i].node].level + 1u;
+    if (!ok) {
+        fprintf(stderr, "%s: %s isn't a checkpoint of this listing\n", "dirlist", filename);
+        exit(-1);
+    }
+
+    for (uint64_t i = 0; i < h->nnodes; i++) {
+        struct ckpt_node *n = &nodes[i];
+        char *name = arena_strdup(&list->arena, pool + n->name);
+        append_node(name, n->parent == NO_PARENT ? NO_PARENT : node_ref(0, n->parent), n->level, n->flags & NODE_DIR, list);
+        if (list->sizing) {
+            list->sizes[i] = n->size;
+            list->blocks[i] = n->blocks;
+        }
+    }
+    for (uint64_t r = 0; r < h->nroots; r++) {      //later checkpoints keep the roots we started from
+        free(walker->root_paths[r]);
+        if ((walker->root_paths[r] = strdup(roots[r])) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for checkpoint; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+
+    /* a root is queued by its absolute path; anything deeper by name under
+     * its parent, so no path handed to the kernel grows with the depth */
+    struct dir_handle **handles = calloc(h->nnodes, sizeof(struct dir_handle *));
+    if (handles == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for checkpoint; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (uint64_t r = 0; r < h->nroots; r++)        //as check_roots() would have, had we not been resuming
+        if (resume_handle(list, r, roots, handles) == NULL)
+            exit(-1);
+    long queued = 0;
+    for (uint64_t i = 0; i < h->nfrontier; i++) {
+        size_t node = frontier[i].node, parent = list->parents[node];
+        struct dir_handle *handle = parent == NO_PARENT ? NULL : resume_handle(list, parent, roots, handles);
+        if (parent != NO_PARENT && handle == NULL)
+            continue;
+        if (handle != NULL)
+            atomic_fetch_add(&handle->refs, 1);
+        char *name = handle ? list->names[node] : arena_strdup(&list->arena, roots[node]);
+        push_item(&walker->workers[queued++ % walker->nworkers].deque,
+                  (struct dir_item) { name, node_ref(0, node), handle, frontier[i].level, SNAP_NONE });
+    }
+    for (uint64_t i = 0; i < h->nnodes; i++)        //the queued items hold their own references
+        if (handles[i] != NULL && handles[i] != &unopenable)
+            release_handle(handles[i]);
+    free(handles);
+    free(roots);
+    munmap(map, size);
+    return queued;
+}
+
+void *walk_runner(void *param)
+{
+    struct worker *self = param;
+    struct walker *walker = self->walker;
+    struct dir_item item;
+    int idle = 0;
+    while (atomic_load(&walker->pending) > 0) {
+        if (walker->options->checkpoint_file != NULL) {
+            if (self->id == 0 && (walk_stop || now() >= walker->next_checkpoint)) {
+                checkpoint_walk(self);
+            } else if (self->id != 0 && atomic_load(&walker->pausing)) {
+                atomic_fetch_add(&walker->parked, 1);
+                while (atomic_load(&walker->pausing))
+                    backoff(&idle);
+                atomic_fetch_sub(&walker->parked, 1);
+                continue;
+            }
+        }
+        int found = pop_item(&self->deque, &item);
+        for (int i = 0; !found && i < walker->nworkers; i++) {
+            struct worker *victim = &walker->workers[rand_r(&self->seed) % walker->nworkers];
+            if (victim != self)
+                found = steal_item(&victim->deque, &item);
+        }
+        if (!found) {               //everyone's deque is empty but scans are still running
+            backoff(&idle);
+            continue;
+        }
+        idle = 0;
+        scan_directory(self, &item);
+        atomic_fetch_sub(&walker->pending, 1);
+    }
+    return NULL;
+}
+
+/* walks the trees rooted at paths[0..npaths) with options->nthreads workers;
+ * the calling thread is worker 0, so a single thread never creates one. Root
+ * r becomes node r, at level 1. The roots are dealt out over the deques and
+ * stealing does the rest, so a small root finishing early leaves no worker
+ * idle while a big one is still being read. Per-worker counters are summed
+ * into stats. list must be empty. */
+void populate_list(char **paths, int npaths, struct list *list, struct walk_options *options, struct stats *stats)
+{
+    struct walker walker;
+    int nthreads = options->nthreads;
+    walker.nworkers = nthreads;
+    walker.options = options;
+    walker.workers = calloc(nthreads, sizeof(struct worker));
+    if (walker.workers == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    atomic_init(&walker.pending, filter_descends(&options->filter, 1) ? npaths : 0);   //the roots, unless --max-depth 0
+    atomic_init(&walker.pausing, 0);
+    atomic_init(&walker.parked, 0);
+    walker.next_checkpoint = now() + options->checkpoint_interval;
+    walker.root_paths = NULL;
+    if (options->checkpoint_file != NULL) {
+        if ((walker.root_paths = calloc(npaths, sizeof(char *))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        for (int r = 0; r < npaths; r++) {      //a root that isn't there now can't be resumed either
+            if ((walker.root_paths[r] = realpath(paths[r], NULL)) == NULL
+                && (walker.root_paths[r] = strdup(paths[r])) == NULL) {
+                fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+    }
+
+    raise_fd_limit();
+    for (int i = 0; i < nthreads; i++) {
+        walker.workers[i].walker = &walker;
+        walker.workers[i].list = i == 0 ? list : create_list();
+        walker.workers[i].list->walking = 1;
+        walker.workers[i].list->sizing = options->sizes_file != NULL;
+        walker.workers[i].seed = i + 1;
+        walker.workers[i].id = i;
+        if (options->reader == READER_GETDENTS && (walker.workers[i].dents = malloc(DENTS_BUFSIZE)) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        pthread_mutex_init(&walker.workers[i].deque.lock, NULL);
+    }
+
+    uint64_t root_snap = options->snapshot ? options->snapshot->header->root_dir : SNAP_NONE;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    if (options->checkpoint_file != NULL) {     //interrupted, leave a checkpoint first
+        sa.sa_handler = stop_walking;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+    long resumed = options->resume ? load_checkpoint(&walker, paths, npaths) : -1;
+    if (resumed >= 0)
+        atomic_store(&walker.pending, resumed);
+    for (int r = 0; r < npaths && resumed < 0; r++) {
+        char *root = arena_strdup(&list->arena, paths[r]);
+        size_t index = append_node(root, NO_PARENT, 1, 1, list);
+        struct stat st;
+        if (list->sizing)
+            set_node_size(index, stat(paths[r], &st) == 0 ? &st : NULL, list);
+        if (filter_descends(&options->filter, 1))
+            push_item(&walker.workers[r % nthreads].deque, (struct dir_item) { root, node_ref(0, index), NULL, 2, root_snap });
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&walker.workers[i].tid, NULL, &walk_runner, &walker.workers[i])) {
+            fprintf(stderr, "%s: could not create thread; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+    walk_runner(&walker.workers[0]);
+    if (options->checkpoint_file != NULL) {     //past the walk there is nothing to save
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
+
+    size_t *base = malloc(nthreads * sizeof(size_t));     //where each worker's nodes start once merged
+    if (base == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for walker; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    base[0] = 0;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_join(walker.workers[i].tid, NULL)) {
+            fprintf(stderr, "%s: could not join thread; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        base[i] = list->count;
+        merge_lists(list, walker.workers[i].list);
+    }
+    for (size_t i = 0; i < list->count; i++)
+        if (list->parents[i] != NO_PARENT)
+            list->parents[i] += base[list->owners[i]];
+    free(list->owners);
+    list->owners = NULL;
+    list->walking = 0;
+    for (size_t k = 0; k < list->ndirs; k++) {
+        size_t ref = list->dirs[k].node;
+        list->dirs[k].node = base[ref >> NODE_REF_SHIFT] + (ref & (((size_t) 1 << NODE_REF_SHIFT) - 1));
+    }
+    free(base);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&walker.workers[i].deque.lock);
+        free(walker.workers[i].deque.items);
+        free(walker.workers[i].dents);
+        free(walker.workers[i].batch);
+        free(walker.workers[i].batch_names);
+        add_stats(stats, &walker.workers[i].stats);
+    }
+    for (int r = 0; r < npaths && walker.root_paths != NULL; r++)
+        free(walker.root_paths[r]);
+    free(walker.root_paths);
+    free(walker.workers);
+}
+
+//deletions
+
+void destroy_list(struct list *list)
+{
+    arena_release(&list->arena);
+    free(list->dirs);
+    free(list->order);
+    free(list->names);
+    free(list->parents);
+    free(list->levels);
+    free(list->flags);
+    free(list->owners);
+    free(list->sizes);
+    free(list->blocks);
+    free(list);
+}
+
+//prints
+
+struct path_buf {           //scratch for rebuilding paths from the name tree
+    char *buf;
+    size_t size;
+    size_t cached_parent;   //node whose path is already at the front of buf
+    size_t cached_len;
+};
+
+void reserve_path(struct path_buf *pb, size_t len)
+{
+    if (len + 1 > pb->size) {
+        pb->size = 2 * len + 256;
+        if ((pb->buf = realloc(pb->buf, pb->size)) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for path; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+}
+
+/* leaves the path of node i's parent at the front of pb->buf and returns its
+ * length (0 for the root). The last parent is cached, since sorted siblings
+ * are usually adjacent. With fill == 0 only the length is worked out. */
+size_t parent_path(struct list *list, size_t i, struct path_buf *pb, int fill)
+{
+    size_t parent = list->parents[i], len = 0, j;
+    if (parent == NO_PARENT)
+        return 0;
+    if (parent == pb->cached_parent)
+        return pb->cached_len;
+    for (j = parent; j != NO_PARENT; j = list->parents[j])
+        len += strlen(list->names[j]) + 1;
+    pb->cached_parent = parent;
+    pb->cached_len = len;
+    if (fill) {
+        reserve_path(pb, len);
+        for (j = parent; j != NO_PARENT; j = list->parents[j]) {     //fill right to left
+            size_t nlen = strlen(list->names[j]);
+            pb->buf[--len] = '/';
+            len -= nlen;
+            memcpy(pb->buf + len, list->names[j], nlen);
+        }
+    }
+    return pb->cached_len;
+}
+
+/* index in the sorted order where the level of entry i begins */
+size_t level_start(struct list *list, size_t i)
+{
+    int level = list->levels[list->order[i]];
+    size_t lo = 0, hi = i;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->levels[list->order[mid]] < level)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* --verify and --diff fingerprint each level as (lines, sum of the lines'
+ * hashes). A line carries its order number, so the set of a level's lines
+ * already fixes their sequence, and a plain sum can be built from slices
+ * in any order. */
+
+struct level_sum {
+    uint64_t count;
+    uint64_t hash;
+    off_t offset;           //reference only: where the level's first line is
+};
+
+/* of a line without its '\n'; eight bytes per step, then a murmur3 finish */
+uint64_t hash_line(const char *p, size_t n)
+{
+    uint64_t h = 1469598103934665603ULL ^ n, word;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    word = 0;
+    memcpy(&word, p, n);
+    h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+}
+
+struct print_job {          //one thread's slice of the sorted order
+    struct list *list;
+    size_t begin;
+    size_t end;
+    size_t first_order;     //order number of the slice's first line
+    off_t offset;           //where the slice starts in the file
+    off_t length;
+    int fd;
+    int fill;               //0: measure the slice, 1: format and write it
+    struct level_sum *sums; //fingerprints of the slice's lines by level, or NULL
+    long bytes;
+    pthread_t tid;
+};
+
+void *print_runner(void *param)
+{
+    struct print_job *job = param;
+    struct list *list = job->list;
+    struct path_buf pb = { NULL, 0, NO_PARENT, 0 };
+    struct writer w;
+    size_t order = job->first_order;
+    if (job->fill)
+        open_writer(&w, job->fd, 1, job->offset);
+    job->length = 0;
+    for (size_t i = job->begin; i < job->end; i++) {
+        uint32_t curr = list->order[i];
+        int level = list->levels[curr];
+        char *name = list->names[curr];
+        if (i > job->begin && level != list->levels[list->order[i - 1]])
+            order = 1;
+        size_t plen = parent_path(list, curr, &pb, job->fill);
+        if (plen > 0)
+            plen--;         //parent_path() counts the separator, write_line() adds it
+        if (job->fill) {
+            write_line(&w, level, order, plen ? pb.buf : name, plen ? plen : strlen(name),
+                       plen ? name : NULL, strlen(name));
+            if (job->sums != NULL) {    //the line is the last thing in the buffer
+                size_t len = line_length(level, order, plen ? plen : strlen(name), plen ? strlen(name) : 0) - 1;
+                job->sums[level].count++;
+                job->sums[level].hash += hash_line(w.buf + w.len - len - 1, len);
+            }
+        } else
+            job->length += line_length(level, order, plen ? plen : strlen(name), plen ? strlen(name) : 0);
+        order++;
+    }
+    if (job->fill) {
+        close_writer(&w);
+        job->bytes = w.bytes;
+    }
+    free(pb.buf);
+    return NULL;
+}
+
+/* with more than one thread the sorted order is cut into slices that are
+ * measured, placed at their offsets and then formatted in parallel. If sums
+ * isn't NULL, sums[level] gets the fingerprint of every level written. */
+long print_list_to_file(struct list *list, char *filename, int nthreads, struct level_sum *sums)
+{
+    int fd = create_output(filename);
+    int nlevels = list->norder > 0 ? list->levels[list->order[list->norder - 1]] : 0;
+    if (list->norder < 65536)   //not worth a second pass
+        nthreads = 1;
+    struct print_job *jobs = calloc(nthreads, sizeof(struct print_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        jobs[t].list = list;
+        jobs[t].begin = list->norder * t / nthreads;
+        jobs[t].end = list->norder * (t + 1) / nthreads;
+        jobs[t].fd = fd;
+        jobs[t].fill = nthreads == 1;
+        if (sums != NULL && (jobs[t].sums = calloc(nlevels + 1, sizeof(struct level_sum))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        if (jobs[t].begin < jobs[t].end)
+            jobs[t].first_order = jobs[t].begin - level_start(list, jobs[t].begin) + 1;
+    }
+    for (int pass = nthreads == 1; pass < 2; pass++) {
+        if (pass == 1 && nthreads > 1) {
+            off_t offset = 0;
+            for (int t = 0; t < nthreads; t++) {
+                jobs[t].offset = offset;
+                jobs[t].fill = 1;
+                offset += jobs[t].length;
+            }
+        }
+        for (int t = 1; t < nthreads; t++) {
+            if (pthread_create(&jobs[t].tid, NULL, &print_runner, &jobs[t])) {
+                fprintf(stderr, "%s: could not create thread; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+        print_runner(&jobs[0]);
+        for (int t = 1; t < nthreads; t++) {
+            if (pthread_join(jobs[t].tid, NULL)) {
+                fprintf(stderr, "%s: could not join thread; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+    }
+    long bytes = 0;
+    for (int t = 0; t < nthreads; t++) {
+        bytes += jobs[t].bytes;
+        for (int l = 1; sums != NULL && l <= nlevels; l++) {
+            sums[l].count += jobs[t].sums[l].count;
+            sums[l].hash += jobs[t].sums[l].hash;
+        }
+        free(jobs[t].sums);
+    }
+    free(jobs);
+    close(fd);
+    return bytes;
+}
+
+//sorts
+
+/* strcmp() for two names where the end of each name reads as term; '/' when
+ * the names stand in for the leading components of longer paths */
+int compare_names(const char *x, const char *y, unsigned char term)
+{
+    while (*x != '\0' && *x == *y)
+        x++, y++;
+    unsigned char cx = *x ? *x : term, cy = *y ? *y : term;
+    return cx - cy;
+}
+
+/* orders two nodes as strcmp() would order their full paths. Same-level
+ * nodes have equally deep ancestries, so climbing both in step reaches the
+ * pair of siblings where the paths first differ. */
+int compare_nodes(const void *a, const void *b, void *arg)
+{
+    struct list *list = arg;
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    if (list->levels[x] != list->levels[y])
+        return list->levels[x] < list->levels[y] ? -1 : 1;
+    unsigned char term = '\0';
+    while (list->parents[x] != list->parents[y]) {
+        x = list->parents[x];
+        y = list->parents[y];
+        term = '/';
+    }
+    return compare_names(list->names[x], list->names[y], term);
+}
+
+/* sort_list() doesn't use compare_nodes(). Like --bfs (see below), it
+ * gives every directory a slash rank within its level. The next level is
+ * then bucketed by the slash rank of each entry's parent, which puts
+ * siblings together with the groups already in order, and only the names
+ * inside a group are compared. The first 8 bytes of each name are cached
+ * big-endian in its key, so most comparisons are one integer compare.
+ * Only ties on those bytes go on to memcmp() over the rest, which libc
+ * vectorizes. */
+
+struct sort_key {
+    uint64_t prefix;        //the name and its terminator, first 8 bytes, zero padded
+    uint32_t len;
+    uint32_t node;
+};
+
+struct key_context {
+    char **names;
+    unsigned char term;     //what ends a name: '\0' for output order, '/' for slash ranks
+};
+
+struct sort_key make_key(char **names, uint32_t node, unsigned char term)
+{
+    const char *name = names[node];
+    struct sort_key key = { 0, strlen(name), node };
+    for (size_t i = 0; i < 8; i++) {
+        unsigned char c = i < key.len ? (unsigned char) name[i] : i == key.len ? term : '\0';
+        key.prefix = key.prefix << 8 | c;
+    }
+    return key;
+}
+
+/* orders sibling names as compare_names() would */
+int compare_keys(const void *a, const void *b, void *arg)
+{
+    const struct sort_key *x = a, *y = b;
+    if (x->prefix != y->prefix)
+        return x->prefix < y->prefix ? -1 : 1;
+    struct key_context *ctx = arg;      //the first 8 bytes agree; look at the rest
+    const char *nx = ctx->names[x->node], *ny = ctx->names[y->node];
+    size_t n = x->len < y->len ? x->len : y->len;
+    if (n > 8) {
+        int cmp = memcmp(nx + 8, ny + 8, n - 8);
+        if (cmp != 0)
+            return cmp;
+    }
+    if (x->len == y->len)
+        return 0;
+    unsigned char cx = x->len > n ? nx[n] : ctx->term, cy = y->len > n ? ny[n] : ctx->term;
+    return cx - cy;
+}
+
+/* sorts on (level, path) into an index array, so the nodes (and the parent
+ * indices pointing at them) stay where they are */
+void sort_list(struct list *list)
+{
+    size_t n = list->count;
+    if (n > UINT32_MAX) {
+        fprintf(stderr, "%s: too many entries to sort (%zu)\n", "dirlist", n);
+        exit(-1);
+    }
+    int levels = 0;
+    for (size_t i = 0; i < n; i++)
+        if (list->levels[i] > levels)
+            levels = list->levels[i];
+    list->order = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *rank = malloc((n + 1) * sizeof(uint32_t));    //slash rank of each directory
+    size_t *start = calloc(levels + 2, sizeof(size_t));
+    if (list->order == NULL || rank == NULL || start == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t i = 0; i < n; i++)      //bucket the nodes by level
+        start[list->levels[i] + 1]++;
+    size_t widest = 0;
+    for (int l = 1; l <= levels + 1; l++) {
+        if (start[l] > widest)
+            widest = start[l];
+        start[l] += start[l - 1];
+    }
+    for (size_t i = 0; i < n; i++)
+        list->order[start[list->levels[i]]++] = i;
+    struct sort_key *keys = malloc((widest + 1) * sizeof(struct sort_key));
+    struct sort_key *dirs = malloc((widest + 1) * sizeof(struct sort_key));
+    size_t *group = malloc((widest + 2) * sizeof(size_t));
+    if (keys == NULL || dirs == NULL || group == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+
+    struct key_context output = { list->names, '\0' }, slash = { list->names, '/' };
+    size_t nparents = 1;        //directories on the level above, i.e. slash ranks in use
+    for (int l = 1; l <= levels; l++) {     //start[l - 1] is now where level l begins
+        uint32_t *order = list->order + start[l - 1];
+        size_t count = start[l] - start[l - 1], next = 0;
+        memset(group, 0, (nparents + 1) * sizeof(size_t));
+        for (size_t i = 0; i < count; i++) {
+            size_t parent = list->parents[order[i]];
+            group[(parent == NO_PARENT ? 0 : rank[parent]) + 1]++;
+        }
+        for (size_t r = 1; r <= nparents; r++)
+            group[r] += group[r - 1];
+        for (size_t i = 0; i < count; i++) {
+            size_t parent = list->parents[order[i]];
+            keys[group[parent == NO_PARENT ? 0 : rank[parent]]++] = make_key(list->names, order[i], '\0');
+        }
+        for (size_t r = 0, begin = 0; r < nparents; begin = group[r++]) {      //group[r] is now where group r ends
+            size_t end = group[r], ndirs = 0;
+            if (end - begin > 1)
+                qsort_r(keys + begin, end - begin, sizeof(struct sort_key), compare_keys, &output);
+            for (size_t i = begin; i < end; i++) {
+                order[i] = keys[i].node;
+                if ((list->flags[order[i]] & NODE_DIR))
+                    dirs[ndirs++] = make_key(list->names, order[i], '/');
+            }
+            if (ndirs > 1)
+                qsort_r(dirs, ndirs, sizeof(struct sort_key), compare_keys, &slash);
+            for (size_t i = 0; i < ndirs; i++)
+                rank[dirs[i].node] = next++;
+        }
+        nparents = next;
+    }
+    list->norder = n;
+    free(keys);
+    free(dirs);
+    free(group);
+    free(start);
+    free(rank);
+}
+
+/* stable partition of the sorted order by root, for --per-root: afterwards
+ * root r's entries are order[start[r]..start[r + 1]), still in (level, path)
+ * order, which is what listing that root alone would produce. The roots are
+ * nodes 0..nroots-1 (see populate_list) and a level's parents are always on
+ * an earlier one, so one pass over the order finds every node's root. */
+size_t *split_roots(struct list *list, int nroots)
+{
+    size_t n = list->norder;
+    uint32_t *root = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc((n + 1) * sizeof(uint32_t));
+    size_t *start = calloc(nroots + 1, sizeof(size_t));
+    if (root == NULL || order == NULL || start == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for list; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint32_t node = list->order[i];
+        root[node] = list->parents[node] == NO_PARENT ? node : root[list->parents[node]];
+        start[root[node] + 1]++;
+    }
+    for (int r = 1; r <= nroots; r++)
+        start[r] += start[r - 1];
+    for (size_t i = 0; i < n; i++)
+        order[start[root[list->order[i]]]++] = list->order[i];
+    for (int r = nroots; r > 0; r--)     //start[r] was bumped to where root r ends
+        start[r] = start[r - 1];
+    start[0] = 0;
+    free(list->order);
+    list->order = order;
+    free(root);
+    return start;
+}
+
+/* binary index */
+
+/* --index FILE writes the sorted listing a second time, in a form that can
+ * be mapped and searched without parsing. Layout, native endian: header,
+ * levels[nlevels], records[nrecords], string pool. Records are in output
+ * order, so each level is the contiguous range its levels entry gives, and
+ * within a level the records are sorted by path. A record's full path is
+ * the names along its parent chain joined by '/', which is enough to
+ * binary search a level for a path or a path prefix. */
+
+#define INDEX_MAGIC "DLINDEX1"
+#define INDEX_NONE UINT64_MAX
+
+struct index_header {
+    char magic[8];
+    uint64_t nlevels;
+    uint64_t nrecords;
+    uint64_t pool_size;
+    uint64_t levels;        //file offsets of the three tables
+    uint64_t records;
+    uint64_t pool;
+};
+
+struct index_level {        //levels[k] is level k + 1
+    uint64_t first;         //record index
+    uint64_t count;
+};
+
+struct index_record {
+    uint64_t order;         //as in the text output, counted from 1 within the level
+    uint64_t parent;        //record index, or INDEX_NONE for the root
+    uint64_t name;          //pool offset of the NUL-terminated name; the root's is its path
+    uint32_t name_len;
+    uint32_t level;
+};
+
+/* writes list's sorted order to filename via a temporary and a rename, so
+ * a consumer never maps a half-written index; returns the bytes written */
+long write_index(struct list *list, char *filename)
+{
+    size_t n = list->norder;
+    uint32_t *rank = malloc((list->count + 1) * sizeof(uint32_t));     //node -> record index
+    size_t tmplen = strlen(filename) + 5;
+    char *tmp = malloc(tmplen);
+    if (rank == NULL || tmp == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for index; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    struct index_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.nrecords = n;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t node = list->order[i];
+        rank[node] = i;
+        h.pool_size += strlen(list->names[node]) + 1;
+        if (list->levels[node] > h.nlevels)
+            h.nlevels = list->levels[node];
+    }
+    h.levels = sizeof(h);
+    h.records = h.levels + h.nlevels * sizeof(struct index_level);
+    h.pool = h.records + n * sizeof(struct index_record);
+
+    snprintf(tmp, tmplen, "%s.tmp", filename);
+    struct writer w;
+    open_writer(&w, create_output(tmp), 0, 0);
+    write_bytes(&w, &h, sizeof(h));
+    for (size_t i = 0, level = 1; level <= h.nlevels; level++) {
+        struct index_level l = { i, 0 };
+        while (i < n && (size_t) list->levels[list->order[i]] == level)
+            i++, l.count++;
+        write_bytes(&w, &l, sizeof(l));
+    }
+    uint64_t name = 0, order = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t node = list->order[i], parent = list->parents[node];
+        if (i == 0 || list->levels[node] != list->levels[list->order[i - 1]])
+            order = 0;
+        struct index_record r = { ++order, parent == NO_PARENT ? INDEX_NONE : rank[parent],
+                                  name, strlen(list->names[node]), list->levels[node] };
+        write_bytes(&w, &r, sizeof(r));
+        name += r.name_len + 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char *s = list->names[list->order[i]];
+        write_bytes(&w, s, strlen(s) + 1);
+    }
+    close_writer(&w);
+    if (close(w.fd) < 0 || rename(tmp, filename) < 0) {
+        fprintf(stderr, "%s: couldn't write index %s; %s\n", "dirlist", filename, strerror(errno));
+        exit(-1);
+    }
+    free(rank);
+    free(tmp);
+    return w.bytes;
+}
+
+/* directory sizes */
+
+/* --sizes FILE stats every entry during the walk and then adds up, for each
+ * directory, the apparent size (st_size) and allocated 512-byte blocks
+ * (st_blocks) of the directory itself and everything listed below it, and
+ * the number of entries below it. Like the listing, the totals skip hidden
+ * entries and anything the filters drop, and count a hard-linked file once
+ * per name. One line per directory, in listing order:
+ *
+ *     level:order:bytes:blocks:entries:path
+ *
+ * where level:order is the directory's own line in the listing. */
+
+/* turns list->sizes and list->blocks into subtree totals and writes them;
+ * returns the bytes written */
+long write_sizes(struct list *list, char *filename)
+{
+    uint64_t *entries = calloc(list->count + 1, sizeof(uint64_t));
+    if (entries == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for sizes; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t k = list->norder; k-- > 0;) {      //deepest level first, so children are done before parents
+        uint32_t node = list->order[k], parent = list->parents[node];
+        if (parent != NO_PARENT) {
+            list->sizes[parent] += list->sizes[node];
+            list->blocks[parent] += list->blocks[node];
+            entries[parent] += entries[node] + 1;
+        }
+    }
+
+    struct writer w;
+    struct path_buf pb = { NULL, 0, NO_PARENT, 0 };
+    size_t order = 0;
+    open_writer(&w, create_output(filename), 0, 0);
+    for (size_t k = 0; k < list->norder; k++) {
+        uint32_t node = list->order[k];
+        int level = list->levels[node];
+        if (k == 0 || level != list->levels[list->order[k - 1]])
+            order = 0;
+        order++;
+        if (!(list->flags[node] & NODE_DIR))
+            continue;
+        size_t plen = parent_path(list, node, &pb, 1), nlen = strlen(list->names[node]);
+        char *p = reserve_output(&w, 5 * 20 + 6 + plen + nlen);
+        p += format_uint(p, level);
+        *p++ = ':';
+        p += format_uint(p, order);
+        *p++ = ':';
+        p += format_uint(p, list->sizes[node]);
+        *p++ = ':';
+        p += format_uint(p, list->blocks[node]);
+        *p++ = ':';
+        p += format_uint(p, entries[node]);
+        *p++ = ':';
+        if (plen > 0)       //a root has no parent path, and pb.buf may still be NULL
+            memcpy(p, pb.buf, plen);
+        memcpy(p + plen, list->names[node], nlen);
+        p += plen + nlen;
+        *p++ = '\n';
+        w.len = p - w.buf;
+    }
+    close_writer(&w);
+    close(w.fd);
+    free(pb.buf);
+    free(entries);
+    return w.bytes;
+}
+
+/* listing comparison */
+
+/* --verify FILE and --diff FILE compare the fresh listing with an earlier
+ * one. While the listing is written each level is fingerprinted (see
+ * level_sum), and one streaming pass over FILE does the same for its
+ * levels, noting where each starts. Levels whose fingerprints agree are
+ * identical and are never looked at again, so comparing two equal listings
+ * costs one sequential read of FILE. --verify stops there. --diff goes
+ * back to each level that differs and merge-joins its lines with the
+ * sorted nodes, reporting on stdout
+ *
+ *     +level:order:path    only in the fresh listing (its new order)
+ *     -level:order:path    only in FILE (its old order)
+ *     ~level:order:path    in both, but out of place in FILE (new order)
+ *
+ * Entries that merely moved up or down because of additions or removals
+ * aren't reported, and of a run of lines that changed places only those off
+ * the longest in-order sequence are. Lines are found by advancing a cursor
+ * through the fresh level, falling back to a binary search for the ones
+ * behind it. Only the current level's matches are held, 12 bytes a line,
+ * never the text of FILE. */
+
+struct line_reader {
+    int fd;
+    char *buf;
+    size_t size;
+    size_t start;           //unread bytes are buf[start..end)
+    size_t end;
+    off_t offset;           //file offset of buf[start]
+    int eof;
+};
+
+void seek_lines(struct line_reader *r, off_t offset)
+{
+    if (lseek(r->fd, offset, SEEK_SET) < 0) {
+        fprintf(stderr, "%s: couldn't read reference listing; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    r->start = r->end = 0;
+    r->offset = offset;
+    r->eof = 0;
+}
+
+/* the next line without its '\n', or NULL at the end of the file */
+char *next_line(struct line_reader *r, size_t *len)
+{
+    for (;;) {
+        char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl != NULL || (r->eof && r->end > r->start)) {
+            char *line = r->buf + r->start;
+            *len = (nl ? nl : r->buf + r->end) - line;
+            r->start += *len + (nl != NULL);
+            r->offset += *len + (nl != NULL);
+            return line;
+        }
+        if (r->eof)
+            return NULL;
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+        if (r->end == r->size && (r->buf = realloc(r->buf, r->size *= 2)) == NULL) {   //a line longer than the buffer
+            fprintf(stderr, "%s: couldn't create memory for reference listing; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        ssize_t n = read(r->fd, r->buf + r->end, r->size - r->end);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "%s: couldn't read reference listing; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        if (n == 0)
+            r->eof = 1;
+        r->end += n;
+    }
+}
+
+/* splits "level:order:path"; 0 if line isn't one */
+int parse_line(char *line, size_t len, unsigned long *level, unsigned long *order, char **path, size_t *plen)
+{
+    char *p = line, *end = line + len;
+    unsigned long *field[2] = { level, order };
+    for (int f = 0; f < 2; f++) {
+        *field[f] = 0;
+        if (p == end || !isdigit((unsigned char) *p))
+            return 0;
+        while (p < end && isdigit((unsigned char) *p) && *field[f] < UINT32_MAX)
+            *field[f] = *field[f] * 10 + (*p++ - '0');
+        if (p == end || *p++ != ':')
+            return 0;
+    }
+    *path = p;
+    *plen = end - p;
+    return *level > 0 && *plen > 0;
+}
+
+/* strcmp() for strings that aren't NUL-terminated */
+int compare_bytes(const char *x, size_t xlen, const char *y, size_t ylen)
+{
+    int cmp = memcmp(x, y, xlen < ylen ? xlen : ylen);
+    return cmp != 0 ? cmp : (xlen > ylen) - (xlen < ylen);
+}
+
+/* node's full path against path[0..len), as strcmp() would order them */
+int compare_to_node(struct list *list, uint32_t node, struct path_buf *pb, const char *path, size_t len)
+{
+    size_t plen = parent_path(list, node, pb, 1);
+    int cmp = plen > 0 ? memcmp(pb->buf, path, plen < len ? plen : len) : 0;
+    if (cmp != 0 || plen >= len)
+        return cmp != 0 ? cmp : 1;      //path is a prefix of the parent's, so shorter
+    return compare_bytes(list->names[node], strlen(list->names[node]), path + plen, len - plen);
+}
+
+void report_node(struct writer *w, char sign, struct list *list, uint32_t node, size_t order, struct path_buf *pb)
+{
+    size_t plen = parent_path(list, node, pb, 1);
+    char *name = list->names[node];
+    write_bytes(w, &sign, 1);
+    write_line(w, list->levels[node], order, plen ? pb->buf : name, plen ? plen - 1 : strlen(name),
+               plen ? name : NULL, strlen(name));
+}
+
+struct ref_line {           //a reference line found in the fresh level
+    uint32_t fresh;         //its index there, counted from the level's start
+    uint32_t prev;          //longest in-order run: the line before it, or UINT32_MAX
+    int in_place;
+};
+
+/* finds path among the fresh nodes order[first..last) that aren't NODE_SEEN
+ * yet, trying the cursor before a binary search; last if it isn't there */
+size_t find_fresh(struct list *list, size_t first, size_t last, size_t *cursor, struct path_buf *pb,
+                  const char *path, size_t len)
+{
+    int cmp = 1;
+    while (*cursor < last && (cmp = compare_to_node(list, list->order[*cursor], pb, path, len)) < 0)
+        (*cursor)++;
+    if (*cursor < last && cmp == 0)
+        return (*cursor)++;
+    size_t lo = first, hi = last;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        cmp = compare_to_node(list, list->order[mid], pb, path, len);
+        if (cmp == 0)
+            return list->flags[list->order[mid]] & NODE_SEEN ? last : mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return last;
+}
+
+/* diffs one level: the reference's lines, which r is positioned at (NULL if
+ * it has none of them), against the fresh nodes order[first..last).
+ * Matching lines form a sequence of fresh positions; the longest increasing
+ * run through it is what stayed in place, and only the rest is reported as
+ * reordered. counts[0..2] are added, removed, reordered. */
+void diff_level(struct list *list, size_t first, size_t last, struct line_reader *r, int level,
+                struct writer *w, long *counts)
+{
+    struct path_buf pb = { NULL, 0, NO_PARENT, 0 };
+    struct ref_line *lines = NULL;
+    uint32_t *tails = NULL;     //tails[k]: the line ending the best in-order run of length k + 1
+    size_t nlines = 0, capacity = 0, tails_capacity = 0, ntails = 0, cursor = first, position = 0, len, plen;
+    unsigned long l, order;
+    char *line, *path;
+    while (r != NULL && (line = next_line(r, &len)) != NULL && parse_line(line, len, &l, &order, &path, &plen)
+           && l == (unsigned long) level) {
+        position++;
+        size_t match = find_fresh(list, first, last, &cursor, &pb, path, plen);
+        if (match == last) {
+            write_bytes(w, "-", 1);
+            write_line(w, level, order, path, plen, NULL, 0);
+            counts[1]++;
+            continue;
+        }
+        list->flags[list->order[match]] |= NODE_SEEN;
+        lines = grow_array(lines, &capacity, nlines + 1, sizeof(struct ref_line));
+        lines[nlines] = (struct ref_line) { match - first, UINT32_MAX, 0 };
+        if (order == position) {    //a misnumbered line is out of place whatever its neighbours
+            size_t lo = 0, hi = ntails;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (lines[tails[mid]].fresh < lines[nlines].fresh)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            tails = grow_array(tails, &tails_capacity, lo + 1, sizeof(uint32_t));
+            lines[nlines].prev = lo > 0 ? tails[lo - 1] : UINT32_MAX;
+            tails[lo] = nlines;
+            if (lo == ntails)
+                ntails++;
+        }
+        nlines++;
+    }
+    for (uint32_t k = ntails > 0 ? tails[ntails - 1] : UINT32_MAX; k != UINT32_MAX; k = lines[k].prev)
+        lines[k].in_place = 1;
+    for (size_t k = 0; k < nlines; k++) {
+        if (!lines[k].in_place) {
+            report_node(w, '~', list, list->order[first + lines[k].fresh], lines[k].fresh + 1, &pb);
+            counts[2]++;
+        }
+    }
+    for (size_t i = first; i < last; i++) {
+        uint32_t node = list->order[i];
+        if (!(list->flags[node] & NODE_SEEN)) {
+            report_node(w, '+', list, node, i - first + 1, &pb);
+            counts[0]++;
+        }
+        list->flags[node] &= ~NODE_SEEN;
+    }
+    free(lines);
+    free(tails);
+    free(pb.buf);
+}
+
+/* compares list, whose levels were fingerprinted into sums[1..] while it was
+ * written, with the listing in filename; returns 1 if they differ */
+int compare_listing(struct list *list, struct level_sum *sums, char *filename, int report)
+{
+    struct line_reader r = { open(filename, O_RDONLY | O_CLOEXEC), malloc(DENTS_BUFSIZE), DENTS_BUFSIZE, 0, 0, 0, 0 };
+    if (r.fd < 0 || r.buf == NULL) {
+        fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", filename, strerror(errno));
+        exit(-1);
+    }
+    posix_fadvise(r.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int nlevels = list->norder > 0 ? list->levels[list->order[list->norder - 1]] : 0;
+    struct level_sum *ref = NULL;
+    size_t ref_capacity = 0, ref_levels = 0, len, plen, lines = 0;
+    unsigned long level, order;
+    char *line, *path;
+    off_t at = 0;
+    while ((line = next_line(&r, &len)) != NULL) {
+        lines++;
+        if (!parse_line(line, len, &level, &order, &path, &plen) || level > UINT16_MAX || level < ref_levels) {
+            fprintf(stderr, "%s: %s:%zu isn't a line of a dirlist listing\n", "dirlist", filename, lines);
+            exit(-1);
+        }
+        if (level > ref_levels) {
+            ref = grow_array(ref, &ref_capacity, level + 1, sizeof(struct level_sum));
+            memset(ref + ref_levels + 1, 0, (level - ref_levels) * sizeof(struct level_sum));
+            ref[level].offset = at;
+            ref_levels = level;
+        }
+        ref[level].count++;
+        ref[level].hash += hash_line(line, len);
+        at = r.offset;
+    }
+
+    long counts[3] = { 0, 0, 0 };
+    int differ = 0, first_diff = 0, top = nlevels > (int) ref_levels ? nlevels : (int) ref_levels;
+    struct writer w;
+    if (report)
+        open_writer(&w, STDOUT_FILENO, 0, 0);
+    for (int l = 1, start = 0; l <= top; l++) {
+        uint64_t count = l <= nlevels ? sums[l].count : 0, hash = l <= nlevels ? sums[l].hash : 0;
+        struct level_sum theirs = l <= (int) ref_levels ? ref[l] : (struct level_sum) { 0, 0, 0 };
+        if (count != theirs.count || hash != theirs.hash) {
+            differ++;
+            first_diff = first_diff ? first_diff : l;
+            if (report && theirs.count > 0)
+                seek_lines(&r, theirs.offset);
+            if (report)
+                diff_level(list, start, start + count, theirs.count > 0 ? &r : NULL, l, &w, counts);
+        }
+        start += count;
+    }
+    if (report) {
+        close_writer(&w);
+        fprintf(stderr, "dirlist: diff: %ld added, %ld removed, %ld reordered; %d of %d level(s) differ from %s\n",
+                counts[0], counts[1], counts[2], differ, top, filename);
+    } else if (differ) {
+        fprintf(stderr, "dirlist: verify: %d of %d level(s) differ from %s, the first is level %d\n",
+                differ, top, filename, first_diff);
+    } else {
+        fprintf(stderr, "dirlist: verify: the listing matches %s\n", filename);
+    }
+    close(r.fd);
+    free(r.buf);
+    free(ref);
+    return differ > 0;
+}
+
+/* breadth-first streaming mode */
+
+/* Instead of walking everything and sorting once, the tree is read a level at
+ * a time, and each level is sorted and written as soon as it is complete.
+ * Only the few levels in flight and the directories of the level above are
+ * ever in memory.
+ *
+ * Paths at one level sort as (parent's path + "/", name). A parent's path
+ * with a '/' appended doesn't always sort like the bare path ("a-b/" < "a/"
+ * but "a" < "a-b"), so each directory also gets a slash rank: its position
+ * when its level's directories are ordered with '/' ending every name.
+ * Children then sort on (slash rank of parent, name) without touching any
+ * full path. */
+
+struct level_entry {
+    char *name;             //in the arena of the level being built
+    uint32_t parent;        //index into the previous level's directories
+    int isdir;
+};
+
+struct file_id {            //what makes two paths the same directory
+    uint64_t dev;
+    uint64_t ino;
+};
+
+struct level {
+    struct level_entry *entries;
+    struct file_id *ids;    //--follow: parallel to entries, set for directories
+    size_t count;
+    size_t capacity;
+    struct arena arena;
+};
+
+struct level_dir {
+    char *path;             //full path, used in messages and to prefix its children
+    char *name;             //the last component of path, opened relative to parent_fd
+    int parent_fd;          //-1 when the parent's fd wasn't kept; path is opened then
+    int fd;                 //kept open by bfs_runner while its subdirectories are read
+    uint32_t rank;          //slash rank within its level
+};
+
+/* A level's directories are opened relative to their parent's fd, as in the
+ * default walker, so a path longer than PATH_MAX costs nothing extra. That
+ * means keeping the fds of every directory with subdirectories until the
+ * next level has been read, and a level can be wider than the fd limit: past
+ * fd_budget, fds are closed, and their children opened by path. */
+
+struct bfs_scan {           //one thread's share of a level
+    struct level_dir *dirs;
+    size_t ndirs;
+    atomic_size_t *next;    //next directory to claim
+    atomic_long *kept;      //fds held for the next level, across all threads
+    long fd_budget;
+    struct walk_options *options;
+    struct level level;
+    struct stats stats;
+    char *dents;
+    pthread_t tid;
+};
+
+/* id is NULL unless --follow */
+void append_level_entry(struct level *level, const char *name, uint32_t parent, int isdir, struct file_id *id)
+{
+    if (level->count == level->capacity) {
+        size_t capacity = level->capacity ? level->capacity * 2 : 1024;
+        struct level_entry *entries = realloc(level->entries, capacity * sizeof(struct level_entry));
+        if (entries == NULL || (id && (level->ids = realloc(level->ids, capacity * sizeof(struct file_id))) == NULL)) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        level->entries = entries;
+        level->capacity = capacity;
+    }
+    if (id)
+        level->ids[level->count] = *id;
+    level->entries[level->count++] = (struct level_entry) { arena_strdup(&level->arena, name), parent, isdir };
+}
+
+/* --follow: like entry_is_dir(), but a symlink counts as the directory it
+ * points to. Anything that may be a directory is stat()ed through links
+ * for its id, so real directories cost a stat here too: a bind mount is
+ * only recognisable by its (st_dev, st_ino). */
+int follow_is_dir(int dfd, struct dir_entry *d, struct file_id *id, struct stats *stats)
+{
+    struct stat buf;
+    if (d->type != DT_DIR && d->type != DT_LNK && d->type != DT_UNKNOWN)
+        return 0;
+    stats->stat_calls++;
+    if (fstatat(dfd, d->name, &buf, 0) != 0 || !S_ISDIR(buf.st_mode))
+        return 0;           //dangling links are listed like any other link
+    *id = (struct file_id) { buf.st_dev, buf.st_ino };
+    return 1;
+}
+
+/* --follow keeps the id of every directory it has descended in an open
+ * addressing set. The set is only touched by the reading thread between
+ * levels, when the next level's directories are picked in slash-rank
+ * order, so a directory reachable by several paths is descended through the
+ * shallowest, and among those the first by path, whatever the thread
+ * timing. The other paths are still listed, but as leaves. A link back to
+ * an ancestor is one of them, which is what keeps cycles finite. */
+
+struct id_set {
+    struct file_id *slots;  //{ 0, 0 } is free; no filesystem hands out inode 0
+    size_t size;
+    size_t count;
+};
+
+size_t hash_id(struct file_id *id)
+{
+    uint64_t h = (id->dev * 0x9e3779b97f4a7c15ULL) ^ id->ino;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;        //murmur3 finalizer
+    return h ^ (h >> 33);
+}
+
+/* 1 if id was new */
+int add_id(struct id_set *set, struct file_id *id)
+{
+    if (2 * (set->count + 1) > set->size) {
+        struct id_set grown = { calloc(set->size ? set->size * 2 : 1024, sizeof(struct file_id)), 0, 0 };
+        if (grown.slots == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        grown.size = set->size ? set->size * 2 : 1024;
+        for (size_t i = 0; i < set->size; i++)
+            if (set->slots[i].ino != 0)
+                add_id(&grown, &set->slots[i]);
+        free(set->slots);
+        *set = grown;
+    }
+    size_t i = hash_id(id) & (set->size - 1);
+    for (; set->slots[i].ino != 0; i = (i + 1) & (set->size - 1))
+        if (set->slots[i].ino == id->ino && set->slots[i].dev == id->dev)
+            return 0;
+    set->slots[i] = *id;
+    set->count++;
+    return 1;
+}
+
+void *bfs_runner(void *param)
+{
+    struct bfs_scan *scan = param;
+    size_t i;
+    while ((i = atomic_fetch_add(scan->next, 1)) < scan->ndirs) {
+        struct level_dir *dir = &scan->dirs[i];
+        int fd = dir->parent_fd >= 0 ? openat(dir->parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                                     : open_dir_path(dir->path);
+        struct dir_reader reader;
+        dir->fd = -1;
+        if (fd < 0 || open_reader(&reader, fd, scan->options->reader, scan->dents, DENTS_BUFSIZE, &scan->stats) < 0) {
+            fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", dir->path, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        scan->stats.dirs_opened++;
+        struct dir_entry d;
+        int subdirs = 0;
+        while (next_entry(&reader, &d)) {
+            scan->stats.entries_read++;
+            if (d.name[0] == '.')       //if hidden file, continue
+                continue;
+            struct file_id id = { 0, 0 };
+            int isdir = scan->options->follow ? follow_is_dir(fd, &d, &id, &scan->stats)
+                                              : entry_is_dir(fd, &d, &scan->stats);
+            if (filter_entry(&scan->options->filter, d.name, isdir, &scan->stats)) {
+                append_level_entry(&scan->level, d.name, i, isdir, scan->options->follow ? &id : NULL);
+                subdirs |= isdir;
+            }
+        }
+        if (subdirs && atomic_fetch_add(scan->kept, 1) < scan->fd_budget) {
+            dir->fd = reader.ds != NULL ? dup(fd) : fd;     //closedir() takes fd with it
+            if (dir->fd < 0)
+                atomic_fetch_sub(scan->kept, 1);
+        } else if (subdirs) {
+            atomic_fetch_sub(scan->kept, 1);
+        }
+        if (reader.ds != NULL)
+            closedir(reader.ds);
+        else if (dir->fd != fd)
+            close(fd);
+    }
+    return NULL;
+}
+
+struct level_key {          //context for the level comparators
+    struct level_entry *entries;
+    struct level_dir *dirs;
+};
+
+int compare_level_entries(const void *a, const void *b, void *arg, unsigned char term)
+{
+    struct level_key *key = arg;
+    struct level_entry *x = &key->entries[*(const uint32_t *) a], *y = &key->entries[*(const uint32_t *) b];
+    uint32_t rx = key->dirs[x->parent].rank, ry = key->dirs[y->parent].rank;
+    if (rx != ry)
+        return rx < ry ? -1 : 1;
+    return compare_names(x->name, y->name, term);
+}
+
+int compare_level_output(const void *a, const void *b, void *arg)
+{
+    return compare_level_entries(a, b, arg, '\0');
+}
+
+int compare_level_slash(const void *a, const void *b, void *arg)
+{
+    return compare_level_entries(a, b, arg, '/');
+}
+
+/* The run is a pipeline of three stages. The calling thread (with its -j
+ * helpers) reads level after level. A sort thread puts each finished level
+ * in output order, and a write thread formats it. Only the slash ranks of
+ * the new directories are worked out before the next level is read, since
+ * reading depends on them. Everything else about a level then happens while
+ * the next one is being read, so sorting and formatting hide behind the
+ * directory I/O. The stages hand levels over through single-producer
+ * single-consumer rings of PIPE_DEPTH slots. That also bounds the memory to
+ * a few levels in flight. */
+
+#define PIPE_DEPTH 2
+
+struct level_batch {        //one level on its way through the pipeline
+    int depth;
+    struct level level;
+    struct level_dir *dirs;     //the level above, which the entries' parent indices point into
+    size_t ndirs;
+    struct arena dir_arena;
+    uint32_t *order;        //set by the sort stage
+    long bytes;             //held, for the stats
+};
+
+struct pipe {               //lock-free ring between two stages; NULL ends the stream
+    struct level_batch *slots[PIPE_DEPTH];
+    atomic_size_t head;     //next slot to take, moved only by the consumer
+    atomic_size_t tail;     //next slot to fill, moved only by the producer
+};
+
+struct bfs_pipeline {
+    struct pipe to_sort;
+    struct pipe to_write;
+    struct writer w;
+    atomic_long held;       //bytes of the levels in flight
+    double sort_time;       //busy time of each stage
+    double output_time;
+    pthread_t sorter;
+    pthread_t writer;
+};
+
+void pipe_push(struct pipe *p, struct level_batch *batch)
+{
+    size_t tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    int idle = 0;
+    while (tail - atomic_load_explicit(&p->head, memory_order_acquire) == PIPE_DEPTH)
+        backoff(&idle);     //the next stage is behind; wait for a free slot
+    p->slots[tail % PIPE_DEPTH] = batch;
+    atomic_store_explicit(&p->tail, tail + 1, memory_order_release);
+}
+
+struct level_batch *pipe_pop(struct pipe *p)
+{
+    size_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    int idle = 0;
+    while (head == atomic_load_explicit(&p->tail, memory_order_acquire))
+        backoff(&idle);
+    struct level_batch *batch = p->slots[head % PIPE_DEPTH];
+    atomic_store_explicit(&p->head, head + 1, memory_order_release);
+    return batch;
+}
+
+void *bfs_sort_stage(void *param)
+{
+    struct bfs_pipeline *pl = param;
+    struct level_batch *b;
+    while ((b = pipe_pop(&pl->to_sort)) != NULL) {
+        double mark = now();
+        if ((b->order = malloc((b->level.count + 1) * sizeof(uint32_t))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        struct level_key key = { b->level.entries, b->dirs };
+        for (size_t i = 0; i < b->level.count; i++)
+            b->order[i] = i;
+        qsort_r(b->order, b->level.count, sizeof(uint32_t), compare_level_output, &key);
+        pl->sort_time += now() - mark;
+        pipe_push(&pl->to_write, b);
+    }
+    pipe_push(&pl->to_write, NULL);
+    return NULL;
+}
+
+void *bfs_write_stage(void *param)
+{
+    struct bfs_pipeline *pl = param;
+    struct level_batch *b;
+    while ((b = pipe_pop(&pl->to_write)) != NULL) {
+        double mark = now();
+        for (size_t i = 0; i < b->level.count; i++) {
+            struct level_entry *e = &b->level.entries[b->order[i]];
+            char *parent = b->dirs[e->parent].path;
+            write_line(&pl->w, b->depth, i + 1, parent, strlen(parent), e->name, strlen(e->name));
+        }
+        flush_writer(&pl->w);       //this level is final; let readers see it now
+        free(b->order);
+        free(b->level.entries);
+        free(b->level.ids);
+        arena_release(&b->level.arena);
+        free(b->dirs);
+        arena_release(&b->dir_arena);
+        atomic_fetch_sub(&pl->held, b->bytes);
+        free(b);
+        pl->output_time += now() - mark;
+    }
+    return NULL;
+}
+
+long stream_bfs(char *path, char *filename, struct walk_options *options, struct stats *stats)
+{
+    double mark = now();
+    struct bfs_pipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    atomic_init(&pl.to_sort.head, 0);
+    atomic_init(&pl.to_sort.tail, 0);
+    atomic_init(&pl.to_write.head, 0);
+    atomic_init(&pl.to_write.tail, 0);
+    atomic_init(&pl.held, 0);
+    open_writer(&pl.w, create_output(filename), 0, 0);
+    int nthreads = options->nthreads;
+    struct bfs_scan *scans = calloc(nthreads, sizeof(struct bfs_scan));
+    struct arena dir_arena = { 0 }, next_arena;
+    struct level_dir *dirs = malloc(sizeof(struct level_dir));
+    if (scans == NULL || dirs == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        if (options->reader == READER_GETDENTS && (scans[t].dents = malloc(DENTS_BUFSIZE)) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+    char *root = arena_strdup(&dir_arena, path);
+    dirs[0] = (struct level_dir) { root, root, -1, -1, 0 };
+    atomic_long kept;
+    atomic_init(&kept, 0);
+    long fd_budget = raise_fd_limit() - 64 - 2 * nthreads;     //the rest is for output, stdio and the readers
+    int *parent_fds = NULL;     //the fds the level being read opens its directories under
+    size_t nparent_fds = 0;
+    size_t ndirs = filter_descends(&options->filter, 1);
+    struct id_set seen = { NULL, 0, 0 };
+    struct stat root_stat;
+    if (options->follow && stat(path, &root_stat) == 0)
+        add_id(&seen, &(struct file_id) { root_stat.st_dev, root_stat.st_ino });
+    write_line(&pl.w, 1, 1, path, strlen(path), NULL, 0);
+    flush_writer(&pl.w);
+    if (pthread_create(&pl.sorter, NULL, &bfs_sort_stage, &pl) || pthread_create(&pl.writer, NULL, &bfs_write_stage, &pl)) {
+        fprintf(stderr, "%s: could not create thread; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+
+    for (int depth = 2; ndirs > 0; depth++) {
+        atomic_size_t next;
+        atomic_init(&next, 0);
+        for (int t = 0; t < nthreads; t++) {
+            scans[t].dirs = dirs;
+            scans[t].ndirs = ndirs;
+            scans[t].next = &next;
+            scans[t].kept = &kept;
+            scans[t].fd_budget = fd_budget;
+            scans[t].options = options;
+            if (t > 0 && pthread_create(&scans[t].tid, NULL, &bfs_runner, &scans[t])) {
+                fprintf(stderr, "%s: could not create thread; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+        bfs_runner(&scans[0]);
+
+        struct level level = scans[0].level;    //gather every thread's entries into one level
+        memset(&scans[0].level, 0, sizeof(struct level));
+        for (int t = 1; t < nthreads; t++) {
+            if (pthread_join(scans[t].tid, NULL)) {
+                fprintf(stderr, "%s: could not join thread; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+            struct level *part = &scans[t].level;
+            if (level.count + part->count > level.capacity) {
+                level.capacity = level.count + part->count;
+                if ((level.entries = realloc(level.entries, level.capacity * sizeof(struct level_entry))) == NULL
+                    || (options->follow && (level.ids = realloc(level.ids, level.capacity * sizeof(struct file_id))) == NULL)) {
+                    fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+                    exit(-1);
+                }
+            }
+            if (part->count > 0) {
+                memcpy(level.entries + level.count, part->entries, part->count * sizeof(struct level_entry));
+                if (options->follow)
+                    memcpy(level.ids + level.count, part->ids, part->count * sizeof(struct file_id));
+            }
+            level.count += part->count;
+            arena_splice(&level.arena, &part->arena);
+            free(part->entries);
+            free(part->ids);
+            memset(part, 0, sizeof(struct level));
+        }
+        for (size_t i = 0; i < nparent_fds; i++)     //every directory under them is open or done
+            close(parent_fds[i]);
+        atomic_fetch_sub(&kept, nparent_fds);
+        free(parent_fds);
+        if (level.count > UINT32_MAX) {
+            fprintf(stderr, "%s: too many entries on level %d (%zu)\n", "dirlist", depth, level.count);
+            exit(-1);
+        }
+
+        size_t nnext = 0;       //the next level's directories, in slash-rank order
+        uint32_t *order = malloc((level.count + 1) * sizeof(uint32_t));
+        if (order == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        for (size_t i = 0; i < level.count && filter_descends(&options->filter, depth); i++)
+            if (level.entries[i].isdir)
+                order[nnext++] = i;
+        struct level_key key = { level.entries, dirs };
+        qsort_r(order, nnext, sizeof(uint32_t), compare_level_slash, &key);
+        if (options->follow) {      //keep the first path to each directory
+            size_t kept = 0;
+            for (size_t i = 0; i < nnext; i++) {
+                if (add_id(&seen, &level.ids[order[i]]))
+                    order[kept++] = order[i];
+                else
+                    stats->dirs_deduped++;
+            }
+            nnext = kept;
+        }
+        struct level_dir *next_dirs = malloc((nnext + 1) * sizeof(struct level_dir));
+        if (next_dirs == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        memset(&next_arena, 0, sizeof(struct arena));
+        for (size_t i = 0; i < nnext; i++) {
+            struct level_entry *e = &level.entries[order[i]];
+            char *parent = dirs[e->parent].path;
+            size_t plen = strlen(parent), nlen = strlen(e->name);
+            char *p = arena_alloc(&next_arena, plen + nlen + 2);
+            memcpy(p, parent, plen);
+            p[plen] = '/';
+            memcpy(p + plen + 1, e->name, nlen + 1);
+            next_dirs[i] = (struct level_dir) { p, p + plen + 1, dirs[e->parent].fd, -1, i };
+        }
+        free(order);
+        if ((parent_fds = malloc((ndirs + 1) * sizeof(int))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        nparent_fds = 0;
+        for (size_t i = 0; i < ndirs; i++)
+            if (dirs[i].fd >= 0)
+                parent_fds[nparent_fds++] = dirs[i].fd;
+
+        struct level_batch *batch = malloc(sizeof(struct level_batch));     //hand the level over
+        if (batch == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for level; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        *batch = (struct level_batch) { depth, level, dirs, ndirs, dir_arena, NULL, 0 };
+        batch->bytes = level.arena.reserved + level.capacity * sizeof(struct level_entry)
+                       + (level.ids ? level.capacity * sizeof(struct file_id) : 0)
+                       + (level.count + 1) * sizeof(uint32_t) + dir_arena.reserved
+                       + (ndirs + 1) * sizeof(struct level_dir);
+        long held = atomic_fetch_add(&pl.held, batch->bytes) + batch->bytes
+                    + next_arena.reserved + (nnext + 1) * sizeof(struct level_dir);
+        if (held > stats->bytes_allocated)
+            stats->bytes_allocated = held;
+        pipe_push(&pl.to_sort, batch);
+        dirs = next_dirs;
+        ndirs = nnext;
+        dir_arena = next_arena;
+    }
+    pipe_push(&pl.to_sort, NULL);
+    for (size_t i = 0; i < nparent_fds; i++)     //kept for a level that --max-depth or --follow emptied
+        close(parent_fds[i]);
+    free(parent_fds);
+    stats->walk_time += now() - mark;
+    if (pthread_join(pl.sorter, NULL) || pthread_join(pl.writer, NULL)) {
+        fprintf(stderr, "%s: could not join thread; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+
+    for (int t = 0; t < nthreads; t++) {
+        free(scans[t].dents);
+        add_stats(stats, &scans[t].stats);
+    }
+    free(scans);
+    free(dirs);
+    free(seen.slots);
+    arena_release(&dir_arena);
+    close_writer(&pl.w);
+    close(pl.w.fd);
+    stats->sort_time += pl.sort_time;
+    stats->output_time += pl.output_time;
+    stats->bytes_written = pl.w.bytes;
+    return pl.w.bytes;
+}
+
+/* external-memory mode */
+
+/* --mem-limit SIZE bounds how much of the listing is held in memory. The tree
+ * is walked depth first and every entry is appended, with its full path, to
+ * a buffer of at most SIZE bytes. Whenever the buffer fills, its records are
+ * sorted on (level, path) and appended as a run to an unlinked temporary
+ * file. At the end the runs are merged through a heap. If there are more
+ * runs than the budget has room for read buffers, they are first merged in
+ * groups into longer runs, and the last pass writes the output. The only
+ * thing kept outside the budget is the stack of directories still waiting
+ * to be read. The walk runs on one thread. */
+
+#define SPILL_READBUF (64 << 10)    //per-run read buffer while merging
+
+struct spill_rec {          //the same in memory and in the run files
+    uint32_t level;
+    uint32_t len;
+    char path[];            //not terminated; records are padded to 4 bytes
+};
+
+struct spill_run {          //a sorted run's place in the temporary file
+    off_t offset;
+    off_t length;
+};
+
+struct spill {
+    char *buf;              //records grow up from the front, their offsets down from the back
+    size_t size;
+    size_t limit;
+    size_t used;
+    size_t count;
+    int fd;                 //temporary file, -1 until the first run
+    struct writer w;
+    struct spill_run *runs;
+    size_t nruns;
+    size_t runs_capacity;
+    struct stats *stats;
+};
+
+struct run_reader {
+    struct spill_run left;  //what hasn't been read yet
+    char *buf;
+    size_t size;
+    size_t pos;
+    size_t len;
+};
+
+size_t spill_rec_size(size_t len)
+{
+    return (sizeof(struct spill_rec) + len + 3) & ~(size_t) 3;
+}
+
+size_t *spill_index(struct spill *sp)
+{
+    return (size_t *) (sp->buf + sp->size) - sp->count;
+}
+
+/* (level, path) with the paths ordered as strcmp() would */
+int compare_spill(const struct spill_rec *x, const struct spill_rec *y)
+{
+    if (x->level != y->level)
+        return x->level < y->level ? -1 : 1;
+    int cmp = memcmp(x->path, y->path, x->len < y->len ? x->len : y->len);
+    if (cmp != 0)
+        return cmp;
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
+int compare_spill_offsets(const void *a, const void *b, void *arg)
+{
+    char *buf = arg;
+    return compare_spill((struct spill_rec *) (buf + *(const size_t *) a), (struct spill_rec *) (buf + *(const size_t *) b));
+}
+
+int open_spill_file()
+{
+    const char *dir = getenv("TMPDIR");
+    size_t len = strlen(dir ? dir : "/tmp") + 16;
+    char *name = malloc(len);
+    if (name == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    snprintf(name, len, "%s/dirlist-XXXXXX", dir ? dir : "/tmp");
+    int fd = mkostemp(name, O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: couldn't create a temporary file in %s; %s\n", "dirlist", dir ? dir : "/tmp", strerror(errno));
+        exit(-1);
+    }
+    unlink(name);           //gone as soon as it's closed, however we exit
+    free(name);
+    return fd;
+}
+
+void add_run(struct spill *sp, off_t offset, off_t length)
+{
+    if (sp->nruns == sp->runs_capacity) {
+        sp->runs_capacity = sp->runs_capacity ? sp->runs_capacity * 2 : 64;
+        if ((sp->runs = realloc(sp->runs, sp->runs_capacity * sizeof(struct spill_run))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+    }
+    sp->runs[sp->nruns++] = (struct spill_run) { offset, length };
+}
+
+/* sorts the buffered records and appends them to the file as one run */
+void write_run(struct spill *sp)
+{
+    double mark = now();
+    size_t *index = spill_index(sp);
+    long held = sp->used + sp->count * sizeof(size_t);
+    if (held > sp->stats->bytes_allocated)
+        sp->stats->bytes_allocated = held;
+    qsort_r(index, sp->count, sizeof(size_t), compare_spill_offsets, sp->buf);
+    if (sp->fd < 0) {
+        sp->fd = open_spill_file();
+        open_writer(&sp->w, sp->fd, 0, 0);
+    }
+    off_t start = sp->w.bytes + sp->w.len;
+    for (size_t i = 0; i < sp->count; i++) {
+        struct spill_rec *r = (struct spill_rec *) (sp->buf + index[i]);
+        write_bytes(&sp->w, r, spill_rec_size(r->len));
+    }
+    add_run(sp, start, sp->w.bytes + sp->w.len - start);
+    sp->used = 0;
+    sp->count = 0;
+    sp->stats->runs_spilled++;
+    sp->stats->sort_time += now() - mark;
+}
+
+/* buffers "prefix[/name]" at level, spilling a run first if it doesn't fit */
+void spill_entry(struct spill *sp, int level, const char *prefix, size_t plen, const char *name, size_t nlen)
+{
+    size_t len = plen + (name ? nlen + 1 : 0), need = spill_rec_size(len) + sizeof(size_t);
+    if (need > sp->limit) {
+        fprintf(stderr, "%s: a path of %zu bytes doesn't fit in --mem-limit\n", "dirlist", len);
+        exit(-1);
+    }
+    while (sp->used + sp->count * sizeof(size_t) + need > sp->size) {
+        if (sp->size == sp->limit) {
+            write_run(sp);
+            continue;
+        }
+        size_t size = sp->size ? sp->size * 2 : ARENA_CHUNK;    //grow towards the limit
+        if (size > sp->limit)
+            size = sp->limit;
+        if ((sp->buf = realloc(sp->buf, size)) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        memmove(sp->buf + size - sp->count * sizeof(size_t), sp->buf + sp->size - sp->count * sizeof(size_t),
+                sp->count * sizeof(size_t));
+        sp->size = size;
+    }
+    struct spill_rec *r = (struct spill_rec *) (sp->buf + sp->used);
+    memset((char *) r + spill_rec_size(len) - 4, 0, 4);     //padding, so the file has no junk in it
+    r->level = level;
+    r->len = len;
+    memcpy(r->path, prefix, plen);
+    if (name != NULL) {
+        r->path[plen] = '/';
+        memcpy(r->path + plen + 1, name, nlen);
+    }
+    sp->count++;
+    spill_index(sp)[0] = sp->used;
+    sp->used += spill_rec_size(len);
+}
+
+/* makes the reader's next record whole in its buffer; returns 0 at the end of the run */
+int fill_run(int fd, struct run_reader *r)
+{
+    for (;;) {
+        size_t avail = r->len - r->pos, need = sizeof(struct spill_rec);
+        if (avail >= need)
+            need = spill_rec_size(((struct spill_rec *) (r->buf + r->pos))->len);
+        if (avail >= need)
+            return 1;
+        if (r->left.length == 0)    //runs hold whole records, so nothing is left over
+            return 0;
+        memmove(r->buf, r->buf + r->pos, avail);
+        r->pos = 0;
+        r->len = avail;
+        if (need > r->size) {
+            r->size = need;
+            if ((r->buf = realloc(r->buf, r->size)) == NULL) {
+                fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+        }
+        size_t want = r->size - r->len;
+        if ((off_t) want > r->left.length)
+            want = r->left.length;
+        ssize_t n = pread(fd, r->buf + r->len, want, r->left.offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "%s: couldn't read spilled run; %s\n", "dirlist", n < 0 ? strerror(errno) : "file truncated");
+            exit(-1);
+        }
+        r->len += n;
+        r->left.offset += n;
+        r->left.length -= n;
+    }
+}
+
+struct spill_rec *run_head(struct run_reader *r)
+{
+    return (struct spill_rec *) (r->buf + r->pos);
+}
+
+void sift_down(struct run_reader *readers, size_t *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t least = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && compare_spill(run_head(&readers[heap[l]]), run_head(&readers[heap[least]])) < 0)
+            least = l;
+        if (r < n && compare_spill(run_head(&readers[heap[r]]), run_head(&readers[heap[least]])) < 0)
+            least = r;
+        if (least == i)
+            return;
+        size_t tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* merges runs of fd into out, either as records of one longer run or, with
+ * lines set, as the final output */
+void merge_runs(int fd, struct spill_run *runs, size_t nruns, struct writer *out, int lines)
+{
+    struct run_reader *readers = calloc(nruns, sizeof(struct run_reader));
+    size_t *heap = malloc(nruns * sizeof(size_t)), n = 0;
+    if (readers == NULL || heap == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t i = 0; i < nruns; i++) {
+        readers[i].left = runs[i];
+        readers[i].size = SPILL_READBUF;
+        if ((readers[i].buf = malloc(SPILL_READBUF)) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        if (fill_run(fd, &readers[i]))
+            heap[n++] = i;
+    }
+    for (size_t i = n / 2; i-- > 0; )
+        sift_down(readers, heap, n, i);
+    uint32_t level = 0;
+    size_t order = 0;
+    while (n > 0) {
+        struct run_reader *r = &readers[heap[0]];
+        struct spill_rec *rec = run_head(r);
+        if (lines) {
+            if (rec->level != level) {
+                level = rec->level;
+                order = 0;
+            }
+            write_line(out, level, ++order, rec->path, rec->len, NULL, 0);
+        } else {
+            write_bytes(out, rec, spill_rec_size(rec->len));
+        }
+        r->pos += spill_rec_size(rec->len);
+        if (!fill_run(fd, r))
+            heap[0] = heap[--n];
+        sift_down(readers, heap, n, 0);
+    }
+    for (size_t i = 0; i < nruns; i++)
+        free(readers[i].buf);
+    free(readers);
+    free(heap);
+}
+
+/* merges the runs down to what fits in one pass, then into filename */
+long finish_spill(struct spill *sp, char *filename)
+{
+    struct writer w;
+    double mark = now();
+    if (sp->fd < 0) {       //everything fit; no need for the disk
+        size_t *index = spill_index(sp);
+        sp->stats->bytes_allocated = sp->used + sp->count * sizeof(size_t);
+        qsort_r(index, sp->count, sizeof(size_t), compare_spill_offsets, sp->buf);
+        sp->stats->sort_time += now() - mark;
+        mark = now();
+        open_writer(&w, create_output(filename), 0, 0);
+        uint32_t level = 0;
+        size_t order = 0;
+        for (size_t i = 0; i < sp->count; i++) {
+            struct spill_rec *r = (struct spill_rec *) (sp->buf + index[i]);
+            if (r->level != level) {
+                level = r->level;
+                order = 0;
+            }
+            write_line(&w, level, ++order, r->path, r->len, NULL, 0);
+        }
+        free(sp->buf);
+    } else {
+        write_run(sp);
+        flush_writer(&sp->w);
+        free(sp->buf);      //the budget now goes to read buffers
+        mark = now();
+        size_t fanin = sp->limit / SPILL_READBUF;
+        if (fanin < 2)
+            fanin = 2;
+        while (sp->nruns > fanin) {
+            struct spill next = { .fd = open_spill_file() };
+            open_writer(&next.w, next.fd, 0, 0);
+            for (size_t i = 0; i < sp->nruns; i += fanin) {
+                off_t start = next.w.bytes + next.w.len;
+                merge_runs(sp->fd, sp->runs + i, sp->nruns - i < fanin ? sp->nruns - i : fanin, &next.w, 0);
+                add_run(&next, start, next.w.bytes + next.w.len - start);
+            }
+            flush_writer(&next.w);
+            sp->stats->bytes_spilled += sp->w.bytes;
+            close_writer(&sp->w);
+            close(sp->fd);
+            free(sp->runs);
+            sp->fd = next.fd;
+            sp->w = next.w;
+            sp->runs = next.runs;
+            sp->nruns = next.nruns;
+            sp->runs_capacity = next.runs_capacity;
+            sp->stats->merge_passes++;
+        }
+        sp->stats->bytes_spilled += sp->w.bytes;
+        sp->stats->sort_time += now() - mark;
+        mark = now();
+        open_writer(&w, create_output(filename), 0, 0);
+        merge_runs(sp->fd, sp->runs, sp->nruns, &w, 1);
+        sp->stats->merge_passes++;
+        close_writer(&sp->w);
+        close(sp->fd);
+        free(sp->runs);
+    }
+    close_writer(&w);
+    close(w.fd);
+    sp->stats->output_time += now() - mark;
+    sp->stats->bytes_written = w.bytes;
+    return w.bytes;
+}
+
+/* a directory waiting to be read; its path is in the pending pool */
+struct pending_dir {
+    size_t offset;
+    int level;              //level of the entries found inside it
+    long parent;            //index of its parent's fd in the open stack, -1 for a root
+};
+
+/* Directories are opened relative to their parent's fd, so a path longer
+ * than PATH_MAX costs nothing extra. A directory's fd goes on the open stack
+ * when it has subdirectories pending. Those come off the pending stack
+ * before anything pushed earlier, so by the time a directory is taken, every
+ * fd above its parent's belongs to a subtree that is done. */
+
+long spill_list(char *path, char *filename, struct walk_options *options, struct stats *stats)
+{
+    double start = now();
+    struct spill sp = { .limit = options->mem_limit & ~(size_t) 7, .fd = -1, .stats = stats };
+    struct path_buf pb = { NULL, 0, NO_PARENT, 0 };
+    struct pending_dir *pending = NULL;
+    int *open_fds = NULL;
+    size_t npending = 0, pending_capacity = 0, pool_len = 0, pool_size = 0, nopen = 0, open_capacity = 0;
+    char *pool = NULL, *dents = NULL;
+    if (options->reader == READER_GETDENTS && (dents = malloc(DENTS_BUFSIZE)) == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for spill; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+
+    size_t plen = strlen(path), nlen;
+    spill_entry(&sp, 1, path, plen, NULL, 0);
+    pool = grow_array(pool, &pool_size, plen + 1, 1);
+    memcpy(pool, path, plen + 1);
+    pending = grow_array(pending, &pending_capacity, 1, sizeof(struct pending_dir));
+    if (filter_descends(&options->filter, 1))
+        pending[npending++] = (struct pending_dir) { 0, 2, -1 };
+    pool_len = plen + 1;
+
+    while (npending > 0) {      //depth first, so the stack stays about as deep as the tree
+        struct pending_dir dir = pending[--npending];
+        plen = pool_len - dir.offset - 1;
+        reserve_path(&pb, plen);
+        memcpy(pb.buf, pool + dir.offset, plen + 1);
+        pool_len = dir.offset;
+
+        while ((long) nopen > dir.parent + 1)
+            if (open_fds[--nopen] >= 0)
+                close(open_fds[nopen]);
+        int fd = dir.parent < 0 || open_fds[dir.parent] < 0 ? open_dir_path(pb.buf)
+                                : openat(open_fds[dir.parent], strrchr(pb.buf, '/') + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct dir_reader reader;
+        if (fd < 0 || open_reader(&reader, fd, options->reader, dents, DENTS_BUFSIZE, stats) < 0) {
+            fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", pb.buf, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        stats->dirs_opened++;
+        struct dir_entry d;
+        size_t first_child = npending;
+        while (next_entry(&reader, &d)) {
+            stats->entries_read++;
+            if (d.name[0] == '.')       //if hidden file, continue
+                continue;
+            int isdir = entry_is_dir(fd, &d, stats);
+            if (!filter_entry(&options->filter, d.name, isdir, stats))
+                continue;
+            nlen = strlen(d.name);
+            spill_entry(&sp, dir.level, pb.buf, plen, d.name, nlen);
+            if (isdir && filter_descends(&options->filter, dir.level)) {
+                pending = grow_array(pending, &pending_capacity, npending + 1, sizeof(struct pending_dir));
+                pending[npending++] = (struct pending_dir) { pool_len, dir.level + 1, nopen };
+                pool = grow_array(pool, &pool_size, pool_len + plen + nlen + 2, 1);
+                memcpy(pool + pool_len, pb.buf, plen);
+                pool[pool_len + plen] = '/';
+                memcpy(pool + pool_len + plen + 1, d.name, nlen + 1);
+                pool_len += plen + nlen + 2;
+            }
+        }
+        int keep = npending > first_child ? (reader.ds != NULL ? dup(fd) : fd) : -1;     //closedir() takes fd with it
+        if (reader.ds != NULL)
+            closedir(reader.ds);
+        else if (keep != fd)
+            close(fd);
+        if (npending > first_child) {       //-1 if the dup() failed; the children are opened by path then
+            open_fds = grow_array(open_fds, &open_capacity, nopen + 1, sizeof(int));
+            open_fds[nopen++] = keep;
+        }
+    }
+    while (nopen > 0)
+        if (open_fds[--nopen] >= 0)
+            close(open_fds[nopen]);
+    free(open_fds);
+    free(dents);
+    free(pb.buf);
+    free(pending);
+    free(pool);
+    stats->walk_time = now() - start - stats->sort_time;
+    return finish_spill(&sp, filename);
+}
+
+/* watch mode */
+
+/* --watch keeps running after the first listing. Every directory gets an
+ * inotify watch, and creates, deletes and moves are applied to the name tree
+ * as they arrive: new entries are appended (a new directory is read and
+ * watched in turn), removed subtrees are marked dead. At most once per
+ * interval the output is brought up to date, either by rewriting it through
+ * a temporary and a rename, or with --watch-log by appending "+level:path"
+ * and "-level:path" lines to a delta log. A rewrite merges the newly sorted
+ * additions into the previous order instead of sorting everything again,
+ * and rewrites the --index file along with it. Moves are handled as a
+ * delete plus a create. Changes made between the walk and the watches being
+ * added aren't seen. */
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+struct watch {
+    struct list *list;
+    struct walk_options *options;
+    struct stats *stats;
+    int fd;                 //inotify instance
+    size_t *wd_node;        //node watched by each watch descriptor, or NO_PARENT
+    size_t nwd;
+    size_t *first_child;    //per-node child links, so subtrees can be found and removed
+    size_t *next_sibling;
+    size_t *prev_sibling;
+    int *node_wd;           //watch descriptor of a directory node, or -1
+    size_t links_capacity;
+    size_t *table;          //open addressing: (parent, name) -> node
+    size_t table_size;
+    size_t table_used;      //including tombstones
+    size_t *added;          //nodes created since the last rewrite
+    size_t nadded;
+    size_t added_capacity;
+    size_t ndead;           //nodes that died since the last rewrite
+    struct writer log;      //--watch-log only
+    struct path_buf pb;
+    int full_warned;        //max_user_watches hit
+};
+
+#define TABLE_EMPTY SIZE_MAX
+#define TABLE_TOMB (SIZE_MAX - 1)
+
+volatile sig_atomic_t watch_stop = 0;
+
+void stop_watching(int sig)
+{
+    (void) sig;
+    watch_stop = 1;
+}
+
+size_t hash_child(size_t parent, const char *name)
+{
+    uint64_t h = 1469598103934665603ULL ^ parent;      //FNV-1a
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 1099511628211ULL;
+    return h;
+}
+
+void table_insert(struct watch *w, size_t node);
+
+void table_resize(struct watch *w, size_t size)
+{
+    size_t *old = w->table, old_size = w->table_size;
+    if ((w->table = malloc(size * sizeof(size_t))) == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for watch; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t i = 0; i < size; i++)
+        w->table[i] = TABLE_EMPTY;
+    w->table_size = size;
+    w->table_used = 0;
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i] < TABLE_TOMB)
+            table_insert(w, old[i]);
+    free(old);
+}
+
+void table_insert(struct watch *w, size_t node)
+{
+    if (2 * (w->table_used + 1) > w->table_size)
+        table_resize(w, w->table_size ? w->table_size * 2 : 4096);
+    size_t i = hash_child(w->list->parents[node], w->list->names[node]) & (w->table_size - 1);
+    while (w->table[i] < TABLE_TOMB)
+        i = (i + 1) & (w->table_size - 1);
+    if (w->table[i] == TABLE_EMPTY)
+        w->table_used++;
+    w->table[i] = node;
+}
+
+/* slot holding the live child name of parent, or SIZE_MAX */
+size_t table_find(struct watch *w, size_t parent, const char *name)
+{
+    size_t i = hash_child(parent, name) & (w->table_size - 1);
+    for (; w->table[i] != TABLE_EMPTY; i = (i + 1) & (w->table_size - 1)) {
+        size_t node = w->table[i];
+        if (node != TABLE_TOMB && w->list->parents[node] == parent && strcmp(w->list->names[node], name) == 0)
+            return i;
+    }
+    return SIZE_MAX;
+}
+
+/* full path of node i, valid until the next call */
+char *watch_path(struct watch *w, size_t i)
+{
+    char *name = w->list->names[i];
+    size_t plen = parent_path(w->list, i, &w->pb, 1), nlen = strlen(name);
+    reserve_path(&w->pb, plen + nlen);
+    memcpy(w->pb.buf + plen, name, nlen + 1);
+    return w->pb.buf;
+}
+
+/* appends "+level:path" or "-level:path" to the delta log */
+void log_change(struct watch *w, char sign, size_t i)
+{
+    if (w->log.buf == NULL)
+        return;
+    char *path = watch_path(w, i);
+    size_t len = strlen(path);
+    if (w->log.len + len + 24 > w->log.size)
+        flush_writer(&w->log);
+    char *p = w->log.buf + w->log.len;
+    *p++ = sign;
+    p += format_uint(p, w->list->levels[i]);
+    *p++ = ':';
+    memcpy(p, path, len);
+    p += len;
+    *p++ = '\n';
+    w->log.len = p - w->log.buf;
+}
+
+void watch_directory(struct watch *w, size_t node)
+{
+    int wd = inotify_add_watch(w->fd, watch_path(w, node), WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC && !w->full_warned++)
+            fprintf(stderr, "%s: out of inotify watches (fs.inotify.max_user_watches); some directories aren't watched\n", "dirlist");
+        else if (errno != ENOSPC && errno != ENOENT)
+            fprintf(stderr, "%s: couldn't watch %s; %s\n", "dirlist", w->pb.buf, strerror(errno));
+        return;
+    }
+    w->wd_node = grow_array(w->wd_node, &w->nwd, wd + 1, sizeof(size_t));
+    w->wd_node[wd] = node;
+    w->node_wd[node] = wd;
+}
+
+/* gives node i its links and table slot; the arrays follow list->capacity */
+void link_node(struct watch *w, size_t i)
+{
+    if (w->links_capacity < w->list->capacity) {
+        size_t capacity = w->links_capacity;
+        w->first_child = grow_array(w->first_child, &capacity, w->list->capacity, sizeof(size_t));
+        capacity = w->links_capacity;
+        w->next_sibling = grow_array(w->next_sibling, &capacity, w->list->capacity, sizeof(size_t));
+        capacity = w->links_capacity;
+        w->prev_sibling = grow_array(w->prev_sibling, &capacity, w->list->capacity, sizeof(size_t));
+        capacity = w->links_capacity;
+        w->node_wd = grow_array(w->node_wd, &capacity, w->list->capacity, sizeof(int));
+        w->links_capacity = capacity;
+    }
+    size_t parent = w->list->parents[i];
+    w->first_child[i] = NO_PARENT;
+    w->node_wd[i] = -1;
+    w->prev_sibling[i] = NO_PARENT;
+    w->next_sibling[i] = NO_PARENT;
+    if (parent != NO_PARENT) {
+        w->next_sibling[i] = w->first_child[parent];
+        if (w->first_child[parent] != NO_PARENT)
+            w->prev_sibling[w->first_child[parent]] = i;
+        w->first_child[parent] = i;
+        table_insert(w, i);
+    }
+}
+
+void add_entry(struct watch *w, size_t parent, const char *name, int isdir);
+
+/* reads a directory that appeared while watching, adding and watching all of it */
+void read_new_directory(struct watch *w, size_t node)
+{
+    watch_directory(w, node);       //first, so nothing created meanwhile is missed
+    int fd = open(watch_path(w, node), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct dir_reader reader;
+    char *dents = w->options->reader == READER_GETDENTS ? malloc(DENTS_BUFSIZE) : NULL;
+    if (fd < 0 || open_reader(&reader, fd, w->options->reader, dents, DENTS_BUFSIZE, w->stats) < 0) {
+        if (fd >= 0)
+            close(fd);
+        free(dents);
+        return;
+    }
+    w->stats->dirs_opened++;
+    struct dir_entry d;
+    while (next_entry(&reader, &d)) {
+        w->stats->entries_read++;
+        if (d.name[0] != '.')
+            add_entry(w, node, d.name, entry_is_dir(fd, &d, w->stats));
+    }
+    if (reader.ds != NULL)
+        closedir(reader.ds);
+    else
+        close(fd);
+    free(dents);
+}
+
+void add_entry(struct watch *w, size_t parent, const char *name, int isdir)
+{
+    if ((w->list->flags[parent] & NODE_DEAD) || table_find(w, parent, name) != SIZE_MAX)
+        return;             //already known, e.g. read along with a new parent
+    if (!filter_entry(&w->options->filter, name, isdir, w->stats))
+        return;
+    size_t i = append_node(arena_strdup(&w->list->arena, name), parent, w->list->levels[parent] + 1, isdir, w->list);
+    link_node(w, i);
+    w->added = grow_array(w->added, &w->added_capacity, w->nadded + 1, sizeof(size_t));
+    w->added[w->nadded++] = i;
+    log_change(w, '+', i);
+    if (isdir && filter_descends(&w->options->filter, w->list->levels[i]))
+        read_new_directory(w, i);
+}
+
+void remove_subtree(struct watch *w, size_t i)
+{
+    for (size_t c = w->first_child[i]; c != NO_PARENT; c = w->next_sibling[c])
+        remove_subtree(w, c);
+    log_change(w, '-', i);
+    size_t slot = table_find(w, w->list->parents[i], w->list->names[i]);
+    if (slot != SIZE_MAX)
+        w->table[slot] = TABLE_TOMB;
+    if (w->node_wd[i] >= 0) {
+        inotify_rm_watch(w->fd, w->node_wd[i]);
+        w->wd_node[w->node_wd[i]] = NO_PARENT;
+    }
+    w->list->flags[i] |= NODE_DEAD;
+    w->ndead++;
+}
+
+void remove_entry(struct watch *w, size_t parent, const char *name)
+{
+    size_t slot = table_find(w, parent, name);
+    if (slot == SIZE_MAX)
+        return;
+    size_t i = w->table[slot];
+    if (w->prev_sibling[i] != NO_PARENT)        //unlink from the parent
+        w->next_sibling[w->prev_sibling[i]] = w->next_sibling[i];
+    else
+        w->first_child[parent] = w->next_sibling[i];
+    if (w->next_sibling[i] != NO_PARENT)
+        w->prev_sibling[w->next_sibling[i]] = w->prev_sibling[i];
+    remove_subtree(w, i);
+}
+
+/* brings the sorted order up to date: drop the dead, sort the additions
+ * and merge the two runs */
+void merge_changes(struct watch *w)
+{
+    struct list *list = w->list;
+    size_t live = 0, nnew = 0;
+    for (size_t j = 0; j < w->nadded; j++)
+        if (!(list->flags[w->added[j]] & NODE_DEAD))
+            w->added[nnew++] = w->added[j];
+    if (list->count > UINT32_MAX) {
+        fprintf(stderr, "%s: too many entries to sort (%zu)\n", "dirlist", list->count);
+        exit(-1);
+    }
+    uint32_t *fresh = malloc((nnew + 1) * sizeof(uint32_t));
+    uint32_t *order = malloc((list->norder + nnew + 1) * sizeof(uint32_t));
+    if (fresh == NULL || order == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for watch; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (size_t j = 0; j < nnew; j++)
+        fresh[j] = w->added[j];
+    qsort_r(fresh, nnew, sizeof(uint32_t), compare_nodes, list);
+    size_t a = 0, b = 0;
+    while (a < list->norder || b < nnew) {
+        if (a < list->norder && (list->flags[list->order[a]] & NODE_DEAD)) {
+            a++;
+        } else if (b == nnew || (a < list->norder && compare_nodes(&list->order[a], &fresh[b], list) < 0)) {
+            order[live++] = list->order[a++];
+        } else {
+            order[live++] = fresh[b++];
+        }
+    }
+    free(fresh);
+    free(list->order);
+    list->order = order;
+    list->norder = live;
+    w->nadded = 0;
+    w->ndead = 0;
+}
+
+void flush_changes(struct watch *w, char *filename)
+{
+    if (w->log.buf != NULL) {
+        flush_writer(&w->log);
+        w->nadded = 0;
+        w->ndead = 0;
+        return;
+    }
+    merge_changes(w);
+    size_t tmplen = strlen(filename) + 5;
+    char *tmp = malloc(tmplen);
+    if (tmp == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for watch; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    snprintf(tmp, tmplen, "%s.tmp", filename);
+    print_list_to_file(w->list, tmp, w->options->nthreads, NULL);
+    if (rename(tmp, filename) < 0)
+        fprintf(stderr, "%s: couldn't replace %s; %s\n", "dirlist", filename, strerror(errno));
+    free(tmp);
+    if (w->options->index_file)
+        write_index(w->list, w->options->index_file);
+}
+
+void handle_event(struct watch *w, struct inotify_event *ev)
+{
+    if (ev->wd < 0 || (size_t) ev->wd >= w->nwd || w->wd_node[ev->wd] == NO_PARENT)
+        return;             //a watch we already dropped
+    size_t dir = w->wd_node[ev->wd];
+    if (ev->mask & IN_IGNORED) {
+        w->wd_node[ev->wd] = NO_PARENT;
+        w->node_wd[dir] = -1;
+        return;
+    }
+    if (ev->mask & IN_DELETE_SELF) {
+        if (w->list->parents[dir] == NO_PARENT) {
+            fprintf(stderr, "%s: %s was removed; stopping\n", "dirlist", w->list->names[dir]);
+            watch_stop = 1;
+        }
+        return;             //the parent's IN_DELETE removes the node
+    }
+    if (ev->len == 0 || ev->name[0] == '.')
+        return;
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        remove_entry(w, dir, ev->name);
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        int isdir = (ev->mask & IN_ISDIR) != 0;
+        if (ev->mask & IN_MOVED_TO)
+            remove_entry(w, dir, ev->name);     //a rename over an existing name
+        add_entry(w, dir, ev->name, isdir);
+    }
+}
+
+void watch_list(struct list *list, char *filename, char *log_file, int interval, struct walk_options *options, struct stats *stats)
+{
+    struct watch w;
+    memset(&w, 0, sizeof(w));
+    w.list = list;
+    w.options = options;
+    w.stats = stats;
+    w.pb.cached_parent = NO_PARENT;
+    if ((w.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) < 0) {
+        fprintf(stderr, "%s: couldn't start inotify; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    if (log_file != NULL) {
+        int fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", log_file, strerror(errno));
+            exit(-1);
+        }
+        open_writer(&w.log, fd, 0, 0);
+    }
+    table_resize(&w, 4096);
+    for (size_t i = 0; i < list->count; i++)
+        link_node(&w, i);
+    for (size_t i = 0; i < list->count; i++)
+        if ((list->flags[i] & NODE_DIR) && filter_descends(&options->filter, list->levels[i]))
+            watch_directory(&w, i);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_watching;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    double due = 0;         //when pending changes must be written; 0 when there are none
+    while (!watch_stop) {
+        struct pollfd pfd = { w.fd, POLLIN, 0 };
+        int timeout = -1;
+        if (due != 0) {
+            double left = due - now();
+            timeout = left > 0 ? (int) (left * 1000) + 1 : 0;
+        }
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "%s: couldn't poll inotify; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        if (ready > 0) {
+            ssize_t len;
+            while ((len = read(w.fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len; ) {
+                    struct inotify_event *ev = (struct inotify_event *) p;
+                    if (ev->mask & IN_Q_OVERFLOW)
+                        fprintf(stderr, "%s: inotify queue overflowed; the listing may be missing changes\n", "dirlist");
+                    else
+                        handle_event(&w, ev);
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+            if ((w.nadded > 0 || w.ndead > 0) && due == 0)
+                due = now() + interval;
+        }
+        if (due != 0 && now() >= due) {
+            flush_changes(&w, filename);
+            due = 0;
+        }
+    }
+    if (w.nadded > 0 || w.ndead > 0)
+        flush_changes(&w, filename);
+
+    if (w.log.buf != NULL) {
+        close_writer(&w.log);
+        close(w.log.fd);
+    }
+    close(w.fd);
+    free(w.wd_node);
+    free(w.first_child);
+    free(w.next_sibling);
+    free(w.prev_sibling);
+    free(w.node_wd);
+    free(w.table);
+    free(w.added);
+    free(w.pb.buf);
+}
+
+/* the counters are bumped unconditionally (worker-local, a few per
+ * directory) and the phases cost one clock read each, so there is nothing to
+ * switch off without --stats; this only decides whether they are shown */
+void print_stats(struct stats *stats, struct walk_options *options, struct list *list)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "dirlist: stats: %d thread(s), %s reader%s%s%s\n", options->nthreads,
+            options->reader == READER_GETDENTS ? "getdents64" : "readdir", options->bfs ? ", breadth first" : "",
+            options->inode_order ? ", inode order" : "", options->follow ? ", following links" : "");
+    fprintf(stderr, "dirlist: stats: time: populate_list %.3f s, sort_list %.3f s, print_list_to_file %.3f s\n",
+            stats->walk_time, stats->sort_time, stats->output_time);
+    fprintf(stderr, "dirlist: stats: %ld directories opened, %ld entries read, %ld stat calls\n",
+            stats->dirs_opened, stats->entries_read, stats->stat_calls);
+    if (options->filter.nexclude > 0 || options->filter.ninclude > 0)
+        fprintf(stderr, "dirlist: stats: %ld entries filtered out\n", stats->entries_filtered);
+    if (options->follow)
+        fprintf(stderr, "dirlist: stats: %ld directories reached again and not descended\n", stats->dirs_deduped);
+    if (stats->compare_time > 0)
+        fprintf(stderr, "dirlist: stats: comparing with the reference listing took %.3f s\n", stats->compare_time);
+    if (options->checkpoint_file)
+        fprintf(stderr, "dirlist: stats: %ld checkpoint(s) written, walk paused %.3f s for them\n",
+                stats->checkpoints, stats->checkpoint_time);
+    if (options->reader == READER_GETDENTS)
+        fprintf(stderr, "dirlist: stats: syscalls: %ld openat, %ld getdents64 (%d KiB buffer), %ld fstatat\n",
+                stats->dirs_opened, stats->getdents_calls, DENTS_BUFSIZE / 1024, stats->stat_calls);
+    else
+        fprintf(stderr, "dirlist: stats: syscalls: %ld openat, %ld fstatat; %ld readdir calls (getdents64 hidden in libc)\n",
+                stats->dirs_opened, stats->stat_calls, stats->readdir_calls);
+    if (list != NULL) {
+        stats->bytes_allocated = list->arena.reserved + list->capacity * NODE_BYTES
+                                 + list->norder * sizeof(uint32_t) + list->dirs_capacity * sizeof(struct dir_stat)
+                                 + (list->sizing ? list->capacity * 2 * sizeof(uint64_t) : 0);
+        fprintf(stderr, "dirlist: stats: arena: %zu chunk(s), %zu bytes used of %zu reserved; node array %zu bytes, sort index %zu bytes\n",
+                list->arena.chunks, list->arena.used, list->arena.reserved, list->capacity * NODE_BYTES,
+                list->norder * sizeof(uint32_t));
+    }
+    if (options->mem_limit)
+        fprintf(stderr, "dirlist: stats: spill: %ld run(s), %ld merge pass(es), %ld bytes spilled\n",
+                stats->runs_spilled, stats->merge_passes, stats->bytes_spilled);
+    fprintf(stderr, "dirlist: stats: %ld bytes allocated, %ld KiB peak RSS, %ld bytes written\n",
+            stats->bytes_allocated, ru.ru_maxrss, stats->bytes_written);
+}
+
+/* main */
+
+/* "64K", "512M", "2G" or plain bytes; 0 if it isn't a size */
+size_t parse_size(const char *s)
+{
+    char *end;
+    if (!isdigit((unsigned char) *s))
+        return 0;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    int shift = 0;
+    switch (toupper((unsigned char) *end)) {
+    case 'G':
+        shift += 10;
+        //fall through
+    case 'M':
+        shift += 10;
+        //fall through
+    case 'K':
+        shift += 10;
+        end++;
+        break;
+    }
+    if (errno != 0 || *end != '\0' || v > (SIZE_MAX >> shift))
+        return 0;
+    return (size_t) v << shift;
+}
+
+void add_pattern(char ***patterns, size_t *count, char *pattern)
+{
+    if ((*patterns = realloc(*patterns, (*count + 1) * sizeof(char *))) == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for options; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    (*patterns)[(*count)++] = pattern;
+}
+
+/* the root that the directory open as fd is, or is inside, other than
+ * skip; -1 if none. Climbs through ".." up to / comparing devices and
+ * inodes, so other spellings of the same path are caught too. Closes fd. */
+int enclosing_root(int fd, struct stat *ids, int nroots, int skip)
+{
+    struct stat st, up;
+    int found = -1;
+    for (int climbing = fstat(fd, &st) == 0; climbing && found < 0; ) {
+        for (int r = 0; r < nroots && found < 0; r++)
+            if (r != skip && ids[r].st_ino == st.st_ino && ids[r].st_dev == st.st_dev)
+                found = r;
+        int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        climbing = parent >= 0 && fstat(parent, &up) == 0 && (up.st_ino != st.st_ino || up.st_dev != st.st_dev);
+        close(fd);
+        fd = parent;
+        st = up;
+    }
+    if (fd >= 0)
+        close(fd);
+    return found;
+}
+
+/* opens each root the way the walker will, so a missing root or one that
+ * isn't a directory fails the run before any output is written instead of
+ * being listed as an empty directory. Unless nested_ok, a root inside
+ * another fails too: the combined listing would hold its subtree twice,
+ * at two different levels. Returns how many failed. */
+int check_roots(char **roots, int nroots, int nested_ok)
+{
+    struct stat *ids = calloc(nroots, sizeof(struct stat));
+    if (ids == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for roots; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    int failed = 0;
+    for (int r = 0; r < nroots; r++) {
+        int fd = open_dir_path(roots[r]);
+        if (fd < 0 || fstat(fd, &ids[r]) < 0) {
+            fprintf(stderr, "%s: couldn't open %s; %s\n", "dirlist", roots[r], strerror(errno));
+            failed++;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    for (int r = 0; r < nroots && !nested_ok && !failed; r++) {
+        int outer = enclosing_root(open_dir_path(roots[r]), ids, nroots, r);
+        if (outer >= 0) {
+            fprintf(stderr, "%s: %s is inside %s; list it once, or use --per-root\n", "dirlist", roots[r], roots[outer]);
+            failed++;
+        }
+    }
+    free(ids);
+    return failed;
+}
+
+/* all of arg as a decimal number from min to max, or -1: unlike atoi(),
+ * "1x", "" and out of range values are refused rather than misread */
+long parse_count(const char *arg, long min, long max)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (!isdigit((unsigned char) arg[0]) || *end != '\0' || errno == ERANGE || n < min || n > max)
+        return -1;
+    return n;
+}
+
+void usage()
+{
+    printf("usage: dirlist [-j threads] [--reader=getdents|readdir] [--bfs] [--snapshot file]\n"
+           "               [--watch[=seconds] [--watch-log=file]] [--mem-limit=size[K|M|G]]\n"
+           "               [--index file] [--max-depth n] [--exclude glob]... [--include glob]...\n"
+           "               [--inode-order] [--follow] [--sizes file] [--checkpoint file\n"
+           "               [--checkpoint-interval seconds] [--resume]] [--verify file | --diff file]\n"
+           "               [--stats] directory_path... file_name\n"
+           "       dirlist [options] --per-root directory_path file_name [directory_path file_name]...\n");
+}
+
+int main(int argc, char **argv)
+{
+    static struct option longopts[] = {
+        { "jobs",   required_argument, NULL, 'j' },
+        { "reader", required_argument, NULL, 'r' },
+        { "stats",  no_argument,       NULL, 's' },
+        { "bfs",    no_argument,       NULL, 'b' },
+        { "snapshot", required_argument, NULL, 'S' },
+        { "watch",  optional_argument, NULL, 'w' },
+        { "watch-log", required_argument, NULL, 'L' },
+        { "mem-limit", required_argument, NULL, 'm' },
+        { "index",  required_argument, NULL, 'i' },
+        { "max-depth", required_argument, NULL, 'd' },
+        { "exclude", required_argument, NULL, 'x' },
+        { "include", required_argument, NULL, 'I' },
+        { "inode-order", no_argument,  NULL, 'o' },
+        { "per-root", no_argument,     NULL, 'p' },
+        { "follow", no_argument,       NULL, 'F' },
+        { "sizes",  required_argument, NULL, 'z' },
+        { "checkpoint", required_argument, NULL, 'c' },
+        { "checkpoint-interval", required_argument, NULL, 'C' },
+        { "resume", no_argument,       NULL, 'R' },
+        { "verify", required_argument, NULL, 'v' },
+        { "diff",   required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct walk_options options = { 1, READER_GETDENTS, 0, NULL, NULL, 0, NULL, { 0, NULL, 0, NULL, 0 }, 0, 0, NULL, NULL, 300, 0 };
+    int opt, show_stats = 0, watch_interval = 0, per_root = 0;
+    char *watch_log = NULL, *end, *compare_file = NULL;
+    int diff_report = 0;
+    long depth;
+    while ((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            if ((options.nthreads = parse_count(optarg, 1, UINT16_MAX)) < 0) {
+                fprintf(stderr, "dirlist: -j must be a positive thread count\n");
+                usage();
+                return -1;
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "getdents") == 0) {
+                options.reader = READER_GETDENTS;
+            } else if (strcmp(optarg, "readdir") == 0) {
+                options.reader = READER_READDIR;
+            } else {
+                fprintf(stderr, "dirlist: --reader must be getdents or readdir\n");
+                return -1;
+            }
+            break;
+        case 's':
+            show_stats = 1;
+            break;
+        case 'b':
+            options.bfs = 1;
+            break;
+        case 'S':
+            options.snapshot_file = optarg;
+            break;
+        case 'w':
+            watch_interval = optarg ? parse_count(optarg, 1, INT_MAX / 1000 - 1) : 5;   //poll() takes milliseconds
+            if (watch_interval < 1) {
+                fprintf(stderr, "dirlist: --watch interval must be a positive number of seconds\n");
+                usage();
+                return -1;
+            }
+            break;
+        case 'L':
+            watch_log = optarg;
+            break;
+        case 'i':
+            options.index_file = optarg;
+            break;
+        case 'd':
+            if ((depth = parse_count(optarg, 0, INT_MAX - 1)) < 0) {
+                fprintf(stderr, "dirlist: --max-depth must be a number of levels\n");
+                usage();
+                return -1;
+            }
+            options.filter.max_level = depth + 1;    //the root is level 1, its entries depth 1
+            break;
+        case 'x':
+            add_pattern(&options.filter.exclude, &options.filter.nexclude, optarg);
+            break;
+        case 'I':
+            add_pattern(&options.filter.include, &options.filter.ninclude, optarg);
+            break;
+        case 'o':
+            options.inode_order = 1;
+            break;
+        case 'p':
+            per_root = 1;
+            break;
+        case 'F':
+            options.follow = 1;
+            break;
+        case 'z':
+            options.sizes_file = optarg;
+            break;
+        case 'c':
+            options.checkpoint_file = optarg;
+            break;
+        case 'C':
+            options.checkpoint_interval = strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(options.checkpoint_interval > 0)) {
+                fprintf(stderr, "dirlist: --checkpoint-interval must be a positive number of seconds\n");
+                return -1;
+            }
+            break;
+        case 'R':
+            options.resume = 1;
+            break;
+        case 'v':
+        case 'D':
+            if (compare_file != NULL) {
+                fprintf(stderr, "dirlist: only one of --verify and --diff can be given\n");
+                return -1;
+            }
+            compare_file = optarg;
+            diff_report = opt == 'D';
+            break;
+        case 'm':
+            options.mem_limit = parse_size(optarg);
+            if (options.mem_limit < SPILL_READBUF) {
+                fprintf(stderr, "dirlist: --mem-limit must be a size of at least %dK\n", SPILL_READBUF / 1024);
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    int nroots = per_root ? (argc - optind) / 2 : argc - optind - 1;
+    if (argc - optind < 2 || (per_root && (argc - optind) % 2 != 0)) {
+        usage();
+        return -1;
+    }
+
+    char **roots = malloc(nroots * sizeof(char *)), **outfiles = malloc(nroots * sizeof(char *));
+    if (roots == NULL || outfiles == NULL) {
+        fprintf(stderr, "%s: couldn't create memory for options; %s\n", "dirlist", strerror(errno));
+        exit(-1);
+    }
+    for (int r = 0; r < nroots; r++) {      //pairs with --per-root, else every root into the last name
+        roots[r] = argv[optind + (per_root ? 2 * r : r)];
+        outfiles[r] = per_root ? argv[optind + 2 * r + 1] : argv[argc - 1];
+    }
+    char *dirpath = roots[0], *outfile = outfiles[0];
+    struct stats stats = { 0 };
+    double start = now();
+    if (options.follow && (nroots > 1 || options.snapshot_file || watch_interval || options.mem_limit
+                           || options.index_file || options.inode_order)) {
+        fprintf(stderr, "dirlist: --follow can't be combined with several roots, --snapshot, --watch, "
+                "--mem-limit, --index or --inode-order\n");
+        return -1;
+    }
+    options.bfs |= options.follow;      //it needs the level-by-level walk to pick paths deterministically
+    if (options.bfs && (options.snapshot_file || watch_interval)) {
+        fprintf(stderr, "dirlist: --snapshot and --watch can't be combined with --bfs\n");
+        return -1;
+    }
+    if (watch_log && !watch_interval) {
+        fprintf(stderr, "dirlist: --watch-log needs --watch\n");
+        return -1;
+    }
+    if (options.mem_limit && (options.bfs || options.snapshot_file || watch_interval)) {
+        fprintf(stderr, "dirlist: --mem-limit can't be combined with --bfs, --snapshot or --watch\n");
+        return -1;
+    }
+    if (options.snapshot_file && (options.filter.max_level || options.filter.nexclude || options.filter.ninclude)) {
+        fprintf(stderr, "dirlist: --snapshot can't be combined with --max-depth, --exclude or --include\n");
+        return -1;
+    }
+    if (options.inode_order && (options.bfs || options.mem_limit)) {
+        fprintf(stderr, "dirlist: --inode-order can't be combined with --bfs or --mem-limit\n");
+        return -1;
+    }
+    if (options.index_file && (options.bfs || options.mem_limit)) {
+        fprintf(stderr, "dirlist: --index can't be combined with --bfs or --mem-limit\n");
+        return -1;
+    }
+    if (nroots > 1 && (options.bfs || options.mem_limit || options.snapshot_file || watch_interval)) {
+        fprintf(stderr, "dirlist: several roots can't be combined with --bfs, --mem-limit, --snapshot or --watch\n");
+        return -1;
+    }
+    if (per_root && options.index_file) {
+        fprintf(stderr, "dirlist: --index can't be combined with --per-root\n");
+        return -1;
+    }
+    if (compare_file && (per_root || options.bfs || options.mem_limit || watch_interval)) {
+        fprintf(stderr, "dirlist: --verify and --diff can't be combined with --per-root, --bfs, --follow, --mem-limit or --watch\n");
+        return -1;
+    }
+    if (options.resume && !options.checkpoint_file) {
+        fprintf(stderr, "dirlist: --resume needs --checkpoint\n");
+        return -1;
+    }
+    if (options.checkpoint_file && (options.bfs || options.mem_limit || options.snapshot_file)) {
+        fprintf(stderr, "dirlist: --checkpoint can't be combined with --bfs, --follow, --mem-limit or --snapshot\n");
+        return -1;
+    }
+    if (options.sizes_file && (per_root || options.bfs || options.mem_limit || options.snapshot_file || watch_interval)) {
+        fprintf(stderr, "dirlist: --sizes can't be combined with --per-root, --bfs, --follow, --mem-limit, --snapshot or --watch\n");
+        return -1;
+    }
+    int resuming = options.resume && access(options.checkpoint_file, F_OK) == 0;   //roots reopened from the checkpoint
+    if (!resuming && check_roots(roots, nroots, per_root) > 0) {
+        free(options.filter.exclude);
+        free(options.filter.include);
+        free(roots);
+        free(outfiles);
+        return -1;
+    }
+    if (options.mem_limit) {
+        spill_list(dirpath, outfile, &options, &stats);
+        if (show_stats)
+            print_stats(&stats, &options, NULL);
+        free(options.filter.exclude);
+        free(options.filter.include);
+        free(roots);
+        free(outfiles);
+        return 0;
+    }
+    if (options.bfs) {
+        stream_bfs(dirpath, outfile, &options, &stats);
+        if (show_stats)
+            print_stats(&stats, &options, NULL);
+        free(options.filter.exclude);
+        free(options.filter.include);
+        free(roots);
+        free(outfiles);
+        return 0;
+    }
+
+    struct snapshot snapshot;
+    if (options.snapshot_file && load_snapshot(&snapshot, options.snapshot_file, dirpath) == 0)
+        options.snapshot = &snapshot;
+    struct list *dirlist = create_list();
+    populate_list(roots, nroots, dirlist, &options, &stats);
+    double mark = now();
+    stats.walk_time = mark - start;
+    sort_list(dirlist);
+    size_t *root_start = per_root ? split_roots(dirlist, nroots) : NULL;
+    struct level_sum *sums = NULL;
+    char *staged = NULL;        //--verify/--diff against outfile itself: where the output waits
+    stats.sort_time = now() - mark;
+    mark = now();
+    if (per_root) {
+        for (int r = 0; r < nroots; r++) {  //print a view of the list holding just root r's slice
+            struct list view = *dirlist;
+            view.order += root_start[r];
+            view.norder = root_start[r + 1] - root_start[r];
+            stats.bytes_written += print_list_to_file(&view, outfiles[r], options.nthreads, NULL);
+        }
+        free(root_start);
+    } else {
+        int nlevels = dirlist->norder > 0 ? dirlist->levels[dirlist->order[dirlist->norder - 1]] : 0;
+        if (compare_file && (sums = calloc(nlevels + 1, sizeof(struct level_sum))) == NULL) {
+            fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+            exit(-1);
+        }
+        /* writing the output would truncate a reference that is the same
+         * file; write beside it and move it into place after the compare */
+        struct stat out_st, ref_st;
+        if (compare_file && stat(outfile, &out_st) == 0 && stat(compare_file, &ref_st) == 0
+            && out_st.st_dev == ref_st.st_dev && out_st.st_ino == ref_st.st_ino) {
+            size_t len = strlen(outfile) + sizeof(".tmp");
+            if ((staged = malloc(len)) == NULL) {
+                fprintf(stderr, "%s: couldn't create memory for output; %s\n", "dirlist", strerror(errno));
+                exit(-1);
+            }
+            snprintf(staged, len, "%s.tmp", outfile);
+        }
+        stats.bytes_written = print_list_to_file(dirlist, staged ? staged : outfile, options.nthreads, sums);
+    }
+    if (options.index_file)
+        stats.bytes_written += write_index(dirlist, options.index_file);
+    if (options.sizes_file)
+        stats.bytes_written += write_sizes(dirlist, options.sizes_file);
+    if (options.checkpoint_file && unlink(options.checkpoint_file) < 0 && errno != ENOENT)
+        fprintf(stderr, "%s: couldn't remove checkpoint %s; %s\n", "dirlist", options.checkpoint_file, strerror(errno));
+    stats.output_time = now() - mark;
+    int differ = 0;
+    if (compare_file) {
+        mark = now();
+        differ = compare_listing(dirlist, sums, compare_file, diff_report);
+        stats.compare_time = now() - mark;
+        free(sums);
+        if (staged && rename(staged, outfile) < 0) {
+            fprintf(stderr, "%s: couldn't rename %s to %s; %s\n", "dirlist", staged, outfile, strerror(errno));
+            exit(-1);
+        }
+        free(staged);
+    }
+    if (options.snapshot_file) {
+        save_snapshot(dirlist, options.snapshot_file);      //before the unmap; reused names point into it
+        fprintf(stderr, "dirlist: snapshot: %ld directories reused, %ld rescanned\n",
+                stats.dirs_reused, stats.dirs_rescanned);
+    }
+    if (show_stats)
+        print_stats(&stats, &options, dirlist);
+    if (watch_interval)
+        watch_list(dirlist, outfile, watch_log, watch_interval, &options, &stats);
+    destroy_list(dirlist);
+    if (options.snapshot)
+        unload_snapshot(options.snapshot);
+    free(options.filter.exclude);
+    free(options.filter.include);
+    free(roots);
+    free(outfiles);
+    return differ;
+}
@@ -1,26 +1,223 @@
 #!/bin/bash
 
 rm *.txt
+rm -rf scratch
 make clean
 make
 
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+# result NUMBER NAME STATUS: prints the line for one test; a STATUS of 0 is a pass
+result() {
+    local left=$(( (57 - ${#2}) / 2 - 4 ))
+    local right=$(( 57 - ${#2} - left ))
+    if [ "$3" -eq 0 ]; then
+        printf 'Test %s - Success%s%s%sSuccess\n' "$1" "$(printf '%*s' $left '' | tr ' ' -)" "$2" "$(printf '%*s' $right '' | tr ' ' -)"
+    else
+        printf 'Test %s - Fail%s%s%sFail\n' "$1" "$(printf '%*s' $((left + 3)) '' | tr ' ' -)" "$2" "$(printf '%*s' $right '' | tr ' ' -)"
+    fi
+}
+
 ./dirlist "$DIR/files/final-src" sout_final-src.txt
 
 sed 's,replace,'"$DIR"',' files/correct_final-src.txt > correct_final-src.txt
 
-if diff -w sout_final-src.txt correct_final-src.txt; then
-    echo Test 1 - Success--------------------final-src----------------------------Success
-else
-    echo Test 1 - Fail-----------------------final-src----------------------------Fail
-fi
+diff -w sout_final-src.txt correct_final-src.txt
+result 1 final-src $?
 
 ./dirlist "$DIR/files/linux-master" sout_linux-master.txt
 
 sed 's,replace,'"$DIR"',' files/correct_linux-master.txt > correct_linux-master.txt
 
-if diff -w sout_linux-master.txt correct_linux-master.txt; then
-    echo Test 2 - Success------------------linux-master---------------------------Success
-else
-    echo Test 2 - Fail---------------------linux-master---------------------------Fail
-fi
+diff -w sout_linux-master.txt correct_linux-master.txt
+result 2 linux-master $?
+
+# the cases below compare other modes against these listings, working in scratch
+mkdir scratch
+
+# the second run must take every directory from the snapshot
+./dirlist --snapshot scratch/walk.snap "$DIR/files/linux-master" scratch/snap1.txt 2> /dev/null &&
+    ./dirlist --snapshot scratch/walk.snap "$DIR/files/linux-master" scratch/snap2.txt 2> scratch/snap.err &&
+    grep -q ' 0 rescanned' scratch/snap.err &&
+    diff -w scratch/snap1.txt sout_linux-master.txt && diff -w scratch/snap2.txt sout_linux-master.txt
+result 3 snapshot $?
+
+# --mem-limit small enough that linux-master spills and merges several runs
+./dirlist --mem-limit=64K "$DIR/files/linux-master" scratch/spill.txt &&
+    diff -w scratch/spill.txt sout_linux-master.txt
+result 4 mem-limit $?
+
+# the index holds one record per listed line; nrecords follows the 8-byte magic
+./dirlist --index scratch/walk.idx "$DIR/files/linux-master" scratch/index.txt &&
+    [ "$(head -c 8 scratch/walk.idx)" = DLINDEX1 ] &&
+    [ "$(od -An -tu8 -j 8 -N 16 scratch/walk.idx | awk '{ print $2 }')" -eq "$(wc -l < scratch/index.txt)" ] &&
+    diff -w scratch/index.txt sout_linux-master.txt
+result 5 index $?
+
+./dirlist --per-root "$DIR/files/final-src" scratch/root1.txt "$DIR/files/linux-master" scratch/root2.txt &&
+    diff -w scratch/root1.txt correct_final-src.txt && diff -w scratch/root2.txt sout_linux-master.txt
+result 6 per-root $?
+
+# "again" is the first path to chap3, so it is descended and chap3 is not;
+# "other" leads out of the tree, and "up" back to the root
+mkdir scratch/follow
+cp -r files/final-src/chap3 scratch/follow/chap3
+ln -s ../../files/final-src/chap4 scratch/follow/other
+ln -s chap3 scratch/follow/again
+ln -s .. scratch/follow/chap3/up
+sed 's,replace,'"$DIR"',' files/correct_follow.txt > scratch/correct_follow.txt
+./dirlist --follow -j 4 "$DIR/scratch/follow" scratch/follow.txt &&
+    diff -w scratch/follow.txt scratch/correct_follow.txt
+result 7 follow $?
+
+# byte and block totals depend on the filesystem; compare the entry counts
+sed 's,replace,'"$DIR"',' files/correct_sizes.txt > scratch/correct_sizes.txt
+./dirlist --sizes scratch/sizes.txt "$DIR/files/final-src" scratch/sizes-out.txt &&
+    cut -d: -f1,2,5- scratch/sizes.txt | diff -w - scratch/correct_sizes.txt &&
+    diff -w scratch/sizes-out.txt correct_final-src.txt
+result 8 sizes $?
+
+# kill a checkpointing run as soon as it has saved one, then finish it
+./dirlist --checkpoint scratch/walk.ckpt --checkpoint-interval 0.0001 "$DIR/files/linux-master" scratch/ckpt.txt &
+pid=$!
+while kill -0 $pid 2> /dev/null && [ ! -e scratch/walk.ckpt ]; do :; done
+kill -9 $pid 2> /dev/null
+wait $pid 2> /dev/null
+./dirlist --checkpoint scratch/walk.ckpt --resume -j 4 "$DIR/files/linux-master" scratch/ckpt.txt &&
+    [ ! -e scratch/walk.ckpt ] && diff -w scratch/ckpt.txt sout_linux-master.txt
+result 9 resume $?
+
+# a copy of final-src with one entry added and one removed
+cp -r files/final-src scratch/src
+./dirlist "$DIR/scratch/src" scratch/before.txt
+touch scratch/src/chap4/added.c
+rm scratch/src/README.txt
+./dirlist "$DIR/scratch/src" scratch/after.txt
+
+# --verify against the output file itself: the reference must be read
+# before it is replaced, then the new listing takes its place
+cp scratch/before.txt scratch/verify.txt
+./dirlist --verify scratch/verify.txt "$DIR/scratch/src" scratch/verify.txt
+status=$?
+[ $status -eq 1 ] && diff -w scratch/verify.txt scratch/after.txt &&
+    ./dirlist --verify scratch/verify.txt "$DIR/scratch/src" scratch/verify.txt
+result 10 verify $?
+
+sed 's,replace,'"$DIR"',' files/correct_diff.txt > scratch/correct_diff.txt
+./dirlist --diff scratch/before.txt "$DIR/scratch/src" scratch/diff-out.txt > scratch/diff.txt
+status=$?
+[ $status -eq 1 ] && diff -w scratch/diff.txt scratch/correct_diff.txt && diff -w scratch/diff-out.txt scratch/after.txt
+result 11 diff $?
+
+# a tree whose deepest paths are longer than PATH_MAX, which the walkers
+# must still read by opening each directory relative to its parent
+name=$(printf 'd%.0s' {1..200})
+mkdir scratch/deep
+(cd scratch/deep && for i in {1..30}; do mkdir "$i$name" side && touch a b side/x && cd "$i$name" || exit 1; done && touch leaf)
+./dirlist "$DIR/scratch/deep" scratch/deep.txt
+
+./dirlist --bfs "$DIR/files/linux-master" scratch/bfs1.txt && diff -w scratch/bfs1.txt sout_linux-master.txt &&
+    ./dirlist --bfs -j 8 "$DIR/files/linux-master" scratch/bfs8.txt && diff -w scratch/bfs8.txt sout_linux-master.txt &&
+    ./dirlist --bfs -j 8 "$DIR/scratch/deep" scratch/bfs-deep.txt && diff -w scratch/bfs-deep.txt scratch/deep.txt &&
+    [ "$(wc -l < scratch/deep.txt)" -eq 152 ]
+result 12 bfs $?
+
+./dirlist --mem-limit=64K "$DIR/scratch/deep" scratch/spill-deep.txt && diff -w scratch/spill-deep.txt scratch/deep.txt
+result 13 mem-limit-deep $?
+
+# resume the deep walk, started with a relative root, from another
+# directory: the frontier is reopened under the saved absolute root, one
+# name at a time. Retried until the kill lands before the walk is done.
+(cd scratch && ../dirlist deep deep-rel.txt)
+for try in {1..20}; do
+    (cd scratch && exec ../dirlist --checkpoint deep.ckpt --checkpoint-interval 0.0001 deep deep-ckpt.txt) &
+    pid=$!
+    while kill -0 $pid 2> /dev/null && [ ! -e scratch/deep.ckpt ]; do :; done
+    kill -9 $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    [ -e scratch/deep.ckpt ] && break
+done
+mkdir scratch/elsewhere
+[ -e scratch/deep.ckpt ] &&
+    (cd scratch/elsewhere && ../../dirlist --checkpoint ../deep.ckpt --resume -j 4 deep ../deep-ckpt.txt) &&
+    diff -w scratch/deep-ckpt.txt scratch/deep-rel.txt
+result 14 resume-deep $?
+
+# a root inside another, however it is spelled, would be listed twice in
+# one output, so it is refused; --per-root lists each on its own
+mkdir -p scratch/nr/a/b scratch/nr/a-b && touch scratch/nr/a/b/x scratch/nr/a-b/y
+! ./dirlist "$DIR/scratch/nr/a" scratch/nr/a/../a/b/ scratch/nested.txt 2> /dev/null && [ ! -e scratch/nested.txt ] &&
+    ./dirlist scratch/nr/a scratch/nr/a-b scratch/nested.txt &&
+    [ "$(cut -d: -f3 scratch/nested.txt | tr '\n' ' ')" = "scratch/nr/a scratch/nr/a-b scratch/nr/a-b/y scratch/nr/a/b scratch/nr/a/b/x " ] &&
+    ./dirlist --per-root scratch/nr/a scratch/nr-a.txt scratch/nr/a/b scratch/nr-b.txt &&
+    [ "$(wc -l < scratch/nr-a.txt)" -eq 3 ] && [ "$(wc -l < scratch/nr-b.txt)" -eq 2 ]
+result 15 nested-roots $?
+
+# the listing mustn't depend on how many workers read it
+./dirlist -j 1 "$DIR/files/final-src" scratch/j1.txt && diff -w scratch/j1.txt correct_final-src.txt &&
+    ./dirlist -j 8 "$DIR/files/final-src" scratch/j8.txt && diff -w scratch/j8.txt scratch/j1.txt &&
+    ./dirlist -j 8 "$DIR/files/linux-master" scratch/j8-linux.txt && diff -w scratch/j8-linux.txt sout_linux-master.txt
+result 16 threads $?
+
+# --max-depth, --exclude and --include prune the listing just as find
+# does, and every walker prunes it the same way
+# filtered NAME ARGS...: lists linux-master with ARGS in each mode
+filtered() {
+    local name=$1
+    shift
+    ./dirlist "$@" "$DIR/files/linux-master" scratch/$name.txt &&
+        ./dirlist -j 8 "$@" "$DIR/files/linux-master" scratch/$name-j8.txt && diff -w scratch/$name-j8.txt scratch/$name.txt &&
+        ./dirlist --bfs -j 4 "$@" "$DIR/files/linux-master" scratch/$name-bfs.txt && diff -w scratch/$name-bfs.txt scratch/$name.txt &&
+        ./dirlist --mem-limit=64K "$@" "$DIR/files/linux-master" scratch/$name-spill.txt && diff -w scratch/$name-spill.txt scratch/$name.txt &&
+        cut -d: -f3- scratch/$name.txt | LC_ALL=C sort > scratch/$name.paths
+}
+visible() {
+    find "$DIR/files/linux-master" ! -path '*/.*' "$@" | LC_ALL=C sort
+}
+filtered depth --max-depth 2 && visible -maxdepth 2 | diff - scratch/depth.paths &&
+    filtered exclude --exclude kernel --exclude '*.txt' &&
+    visible ! -path '*/kernel' ! -path '*/kernel/*' ! -name '*.txt' | diff - scratch/exclude.paths &&
+    filtered include --include '*.c' --include '*.h' &&
+    visible \( -type d -o -name '*.c' -o -name '*.h' \) | diff - scratch/include.paths &&
+    ! ./dirlist --max-depth 2x "$DIR/files/linux-master" scratch/depth.txt > /dev/null 2>&1
+result 17 filters $?
+
+# reading each directory's entries in inode order changes only the order
+# they are fetched in, never the listing
+./dirlist --inode-order "$DIR/files/linux-master" scratch/inode.txt && cmp -s scratch/inode.txt sout_linux-master.txt &&
+    ./dirlist --inode-order -j 8 "$DIR/files/linux-master" scratch/inode8.txt && cmp -s scratch/inode8.txt sout_linux-master.txt &&
+    ./dirlist --inode-order "$DIR/scratch/deep" scratch/inode-deep.txt && cmp -s scratch/inode-deep.txt scratch/deep.txt
+result 18 inode-order $?
+
+# the readdir() backend must list exactly what the default getdents64 one does
+./dirlist --reader=readdir "$DIR/files/linux-master" scratch/readdir.txt && cmp -s scratch/readdir.txt sout_linux-master.txt &&
+    ./dirlist --reader=readdir -j 8 "$DIR/files/linux-master" scratch/readdir8.txt && cmp -s scratch/readdir8.txt sout_linux-master.txt &&
+    ./dirlist --reader=readdir "$DIR/scratch/deep" scratch/readdir-deep.txt && cmp -s scratch/readdir-deep.txt scratch/deep.txt &&
+    ./dirlist --reader=getdents "$DIR/files/final-src" scratch/getdents.txt && cmp -s scratch/getdents.txt sout_final-src.txt
+result 19 readdir $?
+
+# --watch: create, move and delete entries under a running watcher, then
+# its output must catch up with a fresh listing. The nested directory is
+# built outside and moved in, so it arrives as one event.
+cp -r files/final-src scratch/watched
+./dirlist --watch=1 "$DIR/scratch/watched" scratch/watch.txt &
+pid=$!
+while kill -0 $pid 2> /dev/null && [ ! -s scratch/watch.txt ]; do sleep 0.1; done
+sleep 1     # the watches are added after the first listing is written
+mkdir -p scratch/stage/new/sub && touch scratch/stage/new/a.c scratch/stage/new/sub/b.c &&
+    mv scratch/stage/new scratch/watched/chap4/new
+touch scratch/watched/chap3/added.txt
+mv scratch/watched/chap4/Driver.java scratch/watched/chap3/Driver.java
+mv scratch/watched/chap3/Simulator scratch/watched/chap4/Simulator2
+rm scratch/watched/README.txt
+rm -r scratch/watched/chap4/new/sub
+./dirlist "$DIR/scratch/watched" scratch/watch-fresh.txt
+for try in {1..50}; do
+    cmp -s scratch/watch.txt scratch/watch-fresh.txt && break
+    sleep 0.2
+done
+kill -TERM $pid 2> /dev/null && wait $pid && cmp -s scratch/watch.txt scratch/watch-fresh.txt &&
+    ! ./dirlist --watch=1x "$DIR/scratch/watched" scratch/watch.txt > /dev/null 2>&1
+result 20 watch $?
+
+rm -rf scratch
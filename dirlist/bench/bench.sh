@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Runs dirlist over generated trees and records wall/user/sys time, peak
+# RSS and syscall counts for each run. Every run appends one JSON object to
+# $BENCH_OUT so results can be compared across commits; a summary table goes
+# to stdout.
+#
+# Tunables (environment):
+#   BENCH_SIZES    entry counts to generate            (default "10000 200000 1000000")
+#   BENCH_FANOUT   entries per directory               (default 20)
+#   BENCH_DEPTH    maximum tree depth                  (default 8)
+#   BENCH_NAMELEN  name length in characters           (default 12)
+#   BENCH_JOBS     thread count for the -j runs        (default: online CPUs)
+#   BENCH_MODES    dirlist flag sets, ';'-separated    (default below)
+#   BENCH_DIR      where generated trees are kept      (default bench/trees)
+#   BENCH_OUT      results file                        (default bench/results.jsonl)
+#   BENCH_DROP_CACHES=1  drop the page cache before each run (needs root)
+#
+# Trees are generated once per parameter set and reused. Syscall counts come
+# from dirlist --stats; when strace is installed a second, traced run also
+# records the total number of syscalls.
+
+cd "$( dirname "${BASH_SOURCE[0]}" )/.." || exit 1
+
+SIZES=${BENCH_SIZES:-"10000 200000 1000000"}
+FANOUT=${BENCH_FANOUT:-20}
+DEPTH=${BENCH_DEPTH:-8}
+NAMELEN=${BENCH_NAMELEN:-12}
+JOBS=${BENCH_JOBS:-$(getconf _NPROCESSORS_ONLN)}
+MODES=${BENCH_MODES:-"--reader=readdir;;-j $JOBS;--bfs;--bfs -j $JOBS"}
+TREES=${BENCH_DIR:-bench/trees}
+OUT=${BENCH_OUT:-bench/results.jsonl}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+mkdir -p "$TREES"
+printf "%-10s %-24s %9s %9s %9s %10s %9s %9s %6s\n" entries mode wall user sys maxrss_kb openat getdents match
+
+field() {   # field NAME FILE: value of NAME=... on the measure line
+    sed -n 's/.*measure:.* '"$1"'=\([^ ]*\).*/\1/p' "$2"
+}
+
+count() {   # count WORD FILE: the number in front of WORD on a stats line
+    grep -o "[0-9][0-9]* $1" "$2" | head -1 | cut -d' ' -f1
+}
+
+for n in $SIZES; do
+    tree="$TREES/n${n}_f${FANOUT}_d${DEPTH}_l${NAMELEN}"
+    if [ ! -d "$tree" ]; then
+        echo "generating $tree" >&2
+        bench/gentree -n "$n" -f "$FANOUT" -d "$DEPTH" -l "$NAMELEN" "$tree" > /dev/null || exit 1
+    fi
+    tree=$(cd "$tree" && pwd)
+    reference=""
+
+    IFS=';' read -ra modes <<< "$MODES"
+    for mode in "${modes[@]}"; do
+        out="$TMP/out.txt"
+        [ "$BENCH_DROP_CACHES" = 1 ] && sync && echo 3 > /proc/sys/vm/drop_caches
+        # shellcheck disable=SC2086
+        bench/measure ./dirlist --stats $mode "$tree" "$out" 2> "$TMP/err" || { cat "$TMP/err" >&2; exit 1; }
+
+        match=true
+        if [ -z "$reference" ]; then
+            reference="$TMP/reference.txt"
+            cp "$out" "$reference"
+        elif ! cmp -s "$out" "$reference"; then
+            match=false
+        fi
+
+        total=null
+        if command -v strace > /dev/null; then
+            # shellcheck disable=SC2086
+            strace -f -c -o "$TMP/strace" ./dirlist $mode "$tree" "$out" 2> /dev/null
+            total=$(awk '$NF == "total" { print $(NF - 2) }' "$TMP/strace")
+            total=${total:-null}
+        fi
+
+        wall=$(field wall "$TMP/err"); user=$(field user "$TMP/err"); sys=$(field sys "$TMP/err")
+        rss=$(field maxrss_kb "$TMP/err")
+        dirs=$(count "directories opened" "$TMP/err"); entries=$(count "entries read" "$TMP/err")
+        openat=$(count openat "$TMP/err"); getdents=$(count getdents64 "$TMP/err"); fstatat=$(count fstatat "$TMP/err")
+        printf "%-10s %-24s %9s %9s %9s %10s %9s %9s %6s\n" "$n" "${mode:-default}" "$wall" "$user" "$sys" "$rss" \
+               "$openat" "${getdents:--}" "$match"
+        printf '{"commit":"%s","time":"%s","entries":%s,"fanout":%s,"depth":%s,"namelen":%s,"mode":"%s",' \
+               "$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$n" "$FANOUT" "$DEPTH" "$NAMELEN" "$mode" >> "$OUT"
+        printf '"wall_s":%s,"user_s":%s,"sys_s":%s,"maxrss_kb":%s,"dirs_opened":%s,"entries_read":%s,' \
+               "$wall" "$user" "$sys" "$rss" "${dirs:-null}" "${entries:-null}" >> "$OUT"
+        printf '"openat":%s,"getdents64":%s,"fstatat":%s,"syscalls_total":%s,"output_matches":%s}\n' \
+               "${openat:-null}" "${getdents:-null}" "${fstatat:-null}" "$total" "$match" >> "$OUT"
+    done
+done
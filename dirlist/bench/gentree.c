@@ -0,0 +1,118 @@
+/*
+ * gentree: builds a synthetic directory tree for benchmarking dirlist
+ *
+ * Directories are filled breadth first: each gets `fanout` entries, of which
+ * the first `dirs`% are subdirectories while the depth limit allows it, until
+ * `entries` entries exist. Files are empty. Names are `namelen` characters,
+ * random letters ending in a base-36 counter so they never collide. There is
+ * always at least one letter before the counter's dot, so no name is hidden
+ * from dirlist as a dotfile, even if that runs past a very short `namelen`.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct dir {
+    char *path;
+    int depth;
+};
+
+void make_name(char *buf, int namelen, unsigned long serial, unsigned int *seed)
+{
+    char tail[16];
+    int t = 0;
+    do {
+        tail[t++] = "0123456789abcdefghijklmnopqrstuvwxyz"[serial % 36];
+        serial /= 36;
+    } while (serial != 0);
+    int i = 0;
+    for (; i < namelen - t - 1 || i == 0; i++)
+        buf[i] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_"[rand_r(seed) % 54];
+    buf[i++] = '.';
+    while (t > 0)
+        buf[i++] = tail[--t];
+    buf[i] = '\0';
+}
+
+void *allocate(void *p, size_t size)     //realloc() or exit
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "gentree: couldn't create memory; %s\n", strerror(errno));
+        exit(1);
+    }
+    return p;
+}
+
+int main(int argc, char **argv)
+{
+    long entries = 100000;
+    int fanout = 20, depth = 8, namelen = 12, dirs = 20, opt;
+    unsigned int seed = 1;
+    while ((opt = getopt(argc, argv, "n:f:d:l:p:s:")) != -1) {
+        switch (opt) {
+        case 'n': entries = atol(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'l': namelen = atoi(optarg); break;
+        case 'p': dirs = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: gentree [-n entries] [-f fanout] [-d depth] [-l name_length] [-p dir_percent] [-s seed] directory\n");
+            return 1;
+        }
+    }
+    if (argc - optind != 1 || entries < 1 || fanout < 1 || depth < 1 || namelen < 2 || namelen > 200 || dirs < 0 || dirs > 100) {
+        fprintf(stderr, "usage: gentree [-n entries] [-f fanout] [-d depth] [-l name_length] [-p dir_percent] [-s seed] directory\n");
+        return 1;
+    }
+    if (mkdir(argv[optind], 0755) < 0) {
+        fprintf(stderr, "gentree: couldn't create %s; %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    size_t head = 0, count = 1, capacity = 1024;
+    struct dir *queue = allocate(NULL, capacity * sizeof(struct dir));
+    queue[0] = (struct dir) { strcpy(allocate(NULL, strlen(argv[optind]) + 1), argv[optind]), 1 };
+    long made = 0;
+    unsigned long serial = 0;
+    char name[256];
+    int ndirs = (fanout * dirs + 99) / 100;
+    while (made < entries && head < count) {
+        struct dir d = queue[head++];
+        int dfd = open(d.path, O_RDONLY | O_DIRECTORY);
+        if (dfd < 0) {
+            fprintf(stderr, "gentree: couldn't open %s; %s\n", d.path, strerror(errno));
+            return 1;
+        }
+        for (int i = 0; i < fanout && made < entries; i++, made++) {
+            make_name(name, namelen, serial++, &seed);
+            if (i < ndirs && d.depth < depth) {
+                if (mkdirat(dfd, name, 0755) < 0) {
+                    fprintf(stderr, "gentree: couldn't create %s/%s; %s\n", d.path, name, strerror(errno));
+                    return 1;
+                }
+                if (count == capacity)
+                    queue = allocate(queue, (capacity *= 2) * sizeof(struct dir));
+                char *path = allocate(NULL, strlen(d.path) + strlen(name) + 2);
+                sprintf(path, "%s/%s", d.path, name);
+                queue[count++] = (struct dir) { path, d.depth + 1 };
+            } else {
+                int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                if (fd < 0) {
+                    fprintf(stderr, "gentree: couldn't create %s/%s; %s\n", d.path, name, strerror(errno));
+                    return 1;
+                }
+                close(fd);
+            }
+        }
+        close(dfd);
+        free(d.path);
+    }
+    printf("%ld\n", made + 1);      //the root is listed too
+    return 0;
+}
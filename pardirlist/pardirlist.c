@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <pthread.h>
+#include <unistd.h>
 
 /* linked list w/ subroutines */
 
@@ -21,7 +22,6 @@ struct node {
     char *path;
     int level;
     int keyword_frequency;
-    pthread_t tid;
     struct node *next;
     struct node *prev;
 };
@@ -43,7 +43,6 @@ struct node *create_node(char *path, int level, int keyword_frequency)
     node->path = strdup(path);
     node->level = level;
     node->keyword_frequency = keyword_frequency;
-    node->tid = 0;
     node->next = NULL;
     node->prev = NULL;
     return node;
@@ -83,48 +82,99 @@ void seq_search_file(struct node *node, char *keyword)
     fclose(fs);
 }
 
-struct psf_args {                                                   //structure to pass to pthread_create()
-    struct node *node;
-    char *keyword;
+struct psf_pool {                                                   //fixed set of workers fed from a ring of file nodes
+    pthread_t *threads;
+    int nthreads;
+    char *keyword;                                                  //shared by every job, so a job is just a node pointer
+    struct node **queue;
+    int cap, head, count;
+    int closing;                                                    //set once populate_list() has queued every file
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
 };
 
+#define PSF_QUEUE_SLOTS 4096
+
 void *psf_runner(void *param);                                      //function prototype for my sanity
 
-void par_search_file(struct node *node, char *keyword)              //wrapper for thread function
+void psf_pool_start(struct psf_pool *pool, int nthreads, char *keyword)
 {
-    pthread_attr_t attributes;
-    struct psf_args *args = malloc(sizeof(struct psf_args));        //allocate new argument for each thread
-    args->node = node;
-    args->keyword = keyword;
-    pthread_attr_init(&attributes);
-    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
-    if (pthread_create(&node->tid, &attributes, &psf_runner, args)) {
+    int i;
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    pool->queue = malloc(PSF_QUEUE_SLOTS * sizeof(struct node *));  //one allocation for every job we will ever queue
+    if (pool->threads == NULL || pool->queue == NULL) {
+        fprintf(stderr, "pardirlist: couldn't create memory for thread pool; %s\n", strerror(errno));
+        exit(-1);
+    }
+    pool->nthreads = nthreads;
+    pool->keyword = keyword;
+    pool->cap = PSF_QUEUE_SLOTS;
+    pool->head = pool->count = 0;
+    pool->closing = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if ((errno = pthread_create(&pool->threads[i], NULL, &psf_runner, pool))) {
             fprintf(stderr, "pardirlist: could not create thread; %s\n", strerror(errno));
             exit(-1);
+        }
     }
 }
 
-void *psf_runner(void *param)                                       //same as seq_search, but with multithreading
+void par_search_file(struct psf_pool *pool, struct node *node)     //queue a file for the pool, waiting while the ring is full
 {
-    //cast void pointer to psf_args pointer so the compiler knows what we're talking about
-    struct psf_args *args = (struct psf_args *) param;
-    FILE *fs;
-    char buff[1025];
-    char *token, *context, *exclude;
-    int frequency;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->cap)
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    pool->queue[(pool->head + pool->count) % pool->cap] = node;
+    pool->count++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
 
-    fs = fopen(args->node->path, "r");                              //must reference the args struct for the node's path
-    context = NULL, exclude  = " \t\n";
-    frequency = 0;
+void *psf_runner(void *param)                                       //pull nodes until the queue is closed and drained
+{
+    struct psf_pool *pool = (struct psf_pool *) param;
+    struct node *node;
 
-    while (fgets(buff, 1025, fs) != NULL)
-        for (token = strtok_r(buff, exclude, &context); token; token = strtok_r(NULL, exclude, &context))
-            if (strcmp(token, args->keyword) == 0)                  //must reference the args struct for the keyword
-                frequency++;
-    args->node->keyword_frequency = frequency;
-    fclose(fs);
-    free(args);                                                     //free memory we allocated to prevent leakage
-    pthread_exit(0);                                                //exit with null value as we passed our node by reference
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->closing)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (pool->count == 0) {                                     //closing and nothing left to do
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        node = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->cap;
+        pool->count--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        seq_search_file(node, pool->keyword);                       //each node is written by exactly one worker
+    }
+}
+
+void psf_pool_finish(struct psf_pool *pool)                         //wait for every queued file, then tear the pool down
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++) {
+        if ((errno = pthread_join(pool->threads[i], NULL))) {
+            fprintf(stderr, "pardirlist: could not join thread; %s\n", strerror(errno));
+            exit(-1);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->threads);
+    free(pool->queue);
 }
 
 //inserts
@@ -153,7 +203,7 @@ void insert_sorted(struct node *node, struct list *list)
     }
 }
 
-void populate_list(char *path, struct list *list, char *keyword, int ispar)
+void populate_list(char *path, struct list *list, char *keyword, struct psf_pool *pool)
 {
     static int current_level = 1;
     if (current_level == 1) {
@@ -178,11 +228,11 @@ void populate_list(char *path, struct list *list, char *keyword, int ispar)
         insert_sorted(new, list);
         if (S_ISDIR(buf.st_mode)) {
             current_level++;
-            populate_list(tmp, list, keyword, ispar);
+            populate_list(tmp, list, keyword, pool);
             current_level--;
         } else {
-            if (ispar == 1)
-                par_search_file(new, keyword);
+            if (pool != NULL)
+                par_search_file(pool, new);
             else
                 seq_search_file(new, keyword);
         }
@@ -206,18 +256,12 @@ void destroy_list(struct list *list)
 
 //prints
 
-void print_list_to_file(struct list *list, char *filename, int ispar)
+void print_list_to_file(struct list *list, char *filename)
 {
     int order;
     struct node *curr = list->head;
     FILE *fs = fopen(filename, "w");
     while (curr != NULL) {
-        if (ispar == 1 && curr->tid != 0) {
-            if (pthread_join(curr->tid, NULL)) {
-                fprintf(stderr, "pardirlist: could not join thread; %s\n", strerror(errno));
-                exit(-1);
-            }
-        }
         if (curr->prev != NULL && curr->level == curr->prev->level)
             order++;
         else
@@ -256,8 +300,8 @@ void insertion_sort_by_level_increasing(struct list *list)
 
 int main(int argc, char **argv)
 {
-    if (argc != 5) {
-        fprintf(stderr, "dirlist: usage: dirlist <directory_path> <keyword> <output_file> <ispar>\n");
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "dirlist: usage: dirlist <directory_path> <keyword> <output_file> <ispar> [<nthreads>]\n");
         return 1;
     }
 
@@ -269,10 +313,24 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    long nthreads = argc == 6 ? atol(argv[5]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) {
+        if (argc == 6) {
+            fprintf(stderr, "dirlist: <nthreads> must be at least 1\n");
+            return 1;
+        }
+        nthreads = 1;                                                   //sysconf() couldn't tell us, so run a single worker
+    }
+
+    struct psf_pool pool;
     struct list *dirlist = create_list();
-    populate_list(dirpath, dirlist, keyword, ispar);
+    if (ispar == 1)
+        psf_pool_start(&pool, nthreads, keyword);
+    populate_list(dirpath, dirlist, keyword, ispar == 1 ? &pool : NULL);
+    if (ispar == 1)
+        psf_pool_finish(&pool);                                         //every frequency is filled in before we sort and print
     insertion_sort_by_level_increasing(dirlist);
-    print_list_to_file(dirlist, outfile, ispar);    
+    print_list_to_file(dirlist, outfile);
     destroy_list(dirlist);
     return 0;
 }